@@ -0,0 +1,251 @@
+#include "AssetReloader.h"
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+void FileWatcher::add(string path) {
+	filesystem::path full = filesystem::absolute(path).lexically_normal();
+	WatchedFile file;
+	file.path = path;
+	file.directory = full.parent_path().string();
+	file.name = full.filename().string();
+	file.lastWrite = lastWriteTime(path);
+	files.push_back(file);
+}
+
+void FileWatcher::start(function<void(const string &)> callback) {
+	onChange = callback;
+	quitting = false;
+	watchThread = thread(&FileWatcher::watchLoop, this);
+}
+
+filesystem::file_time_type FileWatcher::lastWriteTime(string &path) {
+	error_code ec;
+	filesystem::file_time_type time = filesystem::last_write_time(path, ec);
+	return ec ? filesystem::file_time_type::min() : time;
+}
+
+#if defined(__linux__)
+void FileWatcher::watchLoop() {
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd < 0) {
+		cout << "WARNING: inotify not available; polling for file changes instead" << endl;
+		pollLoop();
+		return;
+	}
+
+	// inotify hands back the same watch descriptor when a directory is added twice
+	map<int, string> directories;
+	for(WatchedFile &file : files) {
+		int wd = inotify_add_watch(fd, file.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if(wd < 0) cout << "WARNING: Could not watch directory: " << file.directory << endl;
+		else directories[wd] = file.directory;
+	}
+
+	alignas(inotify_event) char buffer[4096];
+	while(!quitting) {
+		// Wake up regularly to notice stop()
+		pollfd pfd = { fd, POLLIN, 0 };
+		if(poll(&pfd, 1, 200) <= 0) continue;
+
+		ssize_t len;
+		while((len = read(fd, buffer, sizeof(buffer))) > 0) {
+			inotify_event *event;
+			for(char *ptr = buffer; ptr < buffer + len; ptr += sizeof(inotify_event) + event->len) {
+				event = (inotify_event*)ptr;
+				auto dir = directories.find(event->wd);
+				if(event->len == 0 || dir == directories.end()) continue;
+				for(WatchedFile &file : files) {
+					if(file.directory == dir->second && file.name == event->name) onChange(file.path);
+				}
+			}
+		}
+	}
+	close(fd);
+}
+
+#endif
+
+void FileWatcher::pollLoop() {
+	while(!quitting) {
+		this_thread::sleep_for(chrono::milliseconds(250));
+		for(WatchedFile &file : files) {
+			filesystem::file_time_type time = lastWriteTime(file.path);
+			if(time != file.lastWrite) {
+				file.lastWrite = time;
+				onChange(file.path);
+			}
+		}
+	}
+}
+
+size_t hashMesh(Mesh &m) {
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&](const void *data, size_t size) {
+		const unsigned char *bytes = (const unsigned char*)data;
+		for(size_t i = 0; i < size; i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+	};
+	add(m.vertices.data(), m.vertices.size()*sizeof(Vertex));
+	add(m.indices.data(), m.indices.size()*sizeof(unsigned int));
+	return (size_t)hash;
+}
+
+void AssetReloader::watchShaders(string vertexPath, string fragPath) {
+	vsPath = vertexPath;
+	fsPath = fragPath;
+	kinds[vertexPath] = RELOAD_SHADER;
+	kinds[fragPath] = RELOAD_SHADER;
+	watcher.add(vertexPath);
+	watcher.add(fragPath);
+}
+
+void AssetReloader::watchShadowShaders(string vertexPath, string geomPath, string fragPath) {
+	shadowVsPath = vertexPath;
+	shadowGsPath = geomPath;
+	shadowFsPath = fragPath;
+	for(const string &path : { vertexPath, geomPath, fragPath }) {
+		kinds[path] = RELOAD_SHADOW_SHADER;
+		watcher.add(path);
+	}
+}
+
+void AssetReloader::start() {
+	quitting = false;
+	loader = thread(&AssetReloader::loaderLoop, this);
+	watcher.start([this](const string &path) { request(path); });
+}
+
+void AssetReloader::stop() {
+	watcher.stop();
+	{
+		lock_guard<mutex> guard(queueMutex);
+		quitting = true;
+	}
+	requestCV.notify_all();
+	if(loader.joinable()) loader.join();
+}
+
+void AssetReloader::takeCompleted(vector<ReloadResult> &results) {
+	lock_guard<mutex> guard(queueMutex);
+	results = move(completed);
+	completed.clear();
+}
+
+void AssetReloader::request(const string &path) {
+	auto kind = kinds.find(path);
+	if(kind == kinds.end()) return;
+	string key = path;
+	if(kind->second == RELOAD_SHADER) key = vsPath;
+	else if(kind->second == RELOAD_SHADOW_SHADER) key = shadowVsPath;
+	{
+		// A save often shows up as several events; queue each file once
+		lock_guard<mutex> guard(queueMutex);
+		if(find(requests.begin(), requests.end(), key) != requests.end()) return;
+		requests.push_back(key);
+	}
+	requestCV.notify_one();
+}
+
+void AssetReloader::loaderLoop() {
+	while(true) {
+		{
+			unique_lock<mutex> lock(queueMutex);
+			requestCV.wait(lock, [this] { return quitting || !requests.empty(); });
+			if(quitting) return;
+		}
+
+		// Let the writer finish (saves that touch several files or write in steps collapse into one reload)
+		this_thread::sleep_for(chrono::milliseconds(SETTLE_MS));
+
+		ReloadResult result;
+		{
+			lock_guard<mutex> guard(queueMutex);
+			if(quitting) return;
+			result.path = requests.front();
+			requests.pop_front();
+		}
+		result.kind = kinds.at(result.path);
+
+		if(load(result)) {
+			{
+				lock_guard<mutex> guard(queueMutex);
+				completed.push_back(move(result));
+			}
+			glfwPostEmptyEvent();
+		}
+	}
+}
+
+bool AssetReloader::load(ReloadResult &result) {
+	try {
+		if(result.kind == RELOAD_SHADER) {
+			result.vertexCode = readFileToString(vsPath);
+			result.fragCode = readFileToString(fsPath);
+			return true;
+		}
+		else if(result.kind == RELOAD_SHADOW_SHADER) {
+			result.vertexCode = readFileToString(shadowVsPath);
+			result.geomCode = readFileToString(shadowGsPath);
+			result.fragCode = readFileToString(shadowFsPath);
+			return true;
+		}
+		else if(result.kind == RELOAD_TEXTURE) {
+			return decodeTexture(result.path, result.image);
+		}
+		else {
+			return importModel(result);
+		}
+	}
+	catch(exception &e) {
+		cout << "Reload of " << result.path << " failed: " << e.what() << endl;
+		return false;
+	}
+}
+
+bool AssetReloader::importModel(ReloadResult &result) {
+	Assimp::Importer importer;
+	const aiScene *scene = importer.ReadFile(result.path.c_str(), aiProcess_Triangulate | aiProcess_GenNormals | aiProcess_JoinIdenticalVertices | aiProcess_CalcTangentSpace);
+	if( (!scene) || (scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE) || !(scene->mRootNode) ) {
+		cout << "Reload of " << result.path << ": import was unsuccessful" << endl;
+		return false;
+	}
+
+	result.meshes.resize(scene->mNumMeshes);
+	result.bvh.reset(new SceneBVH());
+	for(int i = 0; i < scene->mNumMeshes; i++) {
+		extractMeshData(scene->mMeshes[i], result.meshes[i]);
+		result.meshHashes.push_back(hashMesh(result.meshes[i]));
+		result.bvh->addMesh(i, result.meshes[i]);
+	}
+	flattenScene(scene->mRootNode, glm::mat4(1.0), result.nodes);
+
+	// Build the BVH here as well, with load-time transforms (the render thread refits it before picking)
+	vector<glm::mat4> transforms(result.nodes.size());
+	for(int i = 0; i < result.nodes.size(); i++) transforms[i] = result.nodes[i].modelMat;
+	WorkerPool serialPool(0);
+	result.bvh->build(result.nodes, transforms, serialPool);
+	return true;
+}
+
+int applyModelReload(ReloadResult &result, vector<MeshGL> &meshgls, vector<size_t> &meshHashes, vector<SceneNode> &nodes, SceneBVH &bvh) {
+	int uploaded = 0;
+	for(int i = 0; i < result.meshes.size(); i++) {
+		if(i < meshgls.size() && meshHashes[i] == result.meshHashes[i]) continue;
+		if(i < meshgls.size()) cleanupMesh(meshgls[i]);
+		else meshgls.push_back(MeshGL());
+		createMeshGL(result.meshes[i], meshgls[i]);
+		uploaded++;
+	}
+	for(int i = (int)result.meshes.size(); i < meshgls.size(); i++) {
+		cleanupMesh(meshgls[i]);
+	}
+	meshgls.resize(result.meshes.size());
+	meshHashes = result.meshHashes;
+	nodes = result.nodes;
+	bvh.swapWith(*result.bvh);
+	return uploaded;
+}
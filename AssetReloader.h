@@ -0,0 +1,132 @@
+#pragma once
+
+#include "BasicGraphics.h"
+#include "SceneBVH.h"
+
+// Watches a set of files and calls onChange(path) from its own thread whenever one is rewritten.
+// On Linux this uses inotify on the files' directories, so editors that save by writing a new file
+// and renaming it over the old one are caught too; elsewhere, modification times are polled instead.
+class FileWatcher {
+public:
+	~FileWatcher() {
+		stop();
+	}
+
+	// Add a file to watch (before start)
+	void add(string path);
+
+	void start(function<void(const string &)> callback);
+
+	void stop() {
+		quitting = true;
+		if(watchThread.joinable()) watchThread.join();
+	}
+
+private:
+	struct WatchedFile {
+		string path;			// As given to add()
+		string directory;
+		string name;
+		filesystem::file_time_type lastWrite;
+	};
+
+	static filesystem::file_time_type lastWriteTime(string &path);
+
+#if defined(__linux__)
+	void watchLoop();
+#else
+	void watchLoop() {
+		pollLoop();
+	}
+#endif
+
+	// Fallback: compare modification times a few times a second
+	void pollLoop();
+
+	vector<WatchedFile> files;
+	function<void(const string &)> onChange;
+	thread watchThread;
+	atomic<bool> quitting{false};
+};
+
+// What a watched file is used as
+enum ReloadKind { RELOAD_SHADER, RELOAD_SHADOW_SHADER, RELOAD_TEXTURE, RELOAD_MODEL };
+
+// Result of one background reload, applied by the render thread between frames
+struct ReloadResult {
+	ReloadKind kind = RELOAD_SHADER;
+	string path;
+	string vertexCode;				// RELOAD_SHADER, RELOAD_SHADOW_SHADER (all stages are always reloaded together)
+	string geomCode;				// RELOAD_SHADOW_SHADER only
+	string fragCode;
+	TextureImage image;				// RELOAD_TEXTURE
+	vector<Mesh> meshes;			// RELOAD_MODEL
+	vector<size_t> meshHashes;
+	vector<SceneNode> nodes;
+	unique_ptr<SceneBVH> bvh;
+};
+
+// FNV-1a hash of a mesh's vertex and index data (tells which meshes of a re-imported model changed)
+size_t hashMesh(Mesh &m);
+
+// Hot reload of shaders, textures and the model.
+// Changed files are read, decoded or imported on a loader thread (no OpenGL calls there);
+// the render thread picks up finished results with takeCompleted() and swaps them in between frames.
+class AssetReloader {
+public:
+	~AssetReloader() {
+		stop();
+	}
+
+	void watchShaders(string vertexPath, string fragPath);
+
+	void watchShadowShaders(string vertexPath, string geomPath, string fragPath);
+
+	void watchTexture(string path) {
+		kinds[path] = RELOAD_TEXTURE;
+		watcher.add(path);
+	}
+
+	void watchModel(string path) {
+		kinds[path] = RELOAD_MODEL;
+		watcher.add(path);
+	}
+
+	// Start watching (add files first)
+	void start();
+
+	void stop();
+
+	// Take everything that finished loading since the last call
+	void takeCompleted(vector<ReloadResult> &results);
+
+private:
+	static constexpr int SETTLE_MS = 100;
+
+	void request(const string &path);
+
+	void loaderLoop();
+
+	// Read, decode or import one changed file; returns false (after printing why) if it can't be used
+	bool load(ReloadResult &result);
+
+	bool importModel(ReloadResult &result);
+
+	FileWatcher watcher;
+	map<string, ReloadKind> kinds;		// Not changed after start(), so both threads can read it
+	string vsPath;
+	string fsPath;
+	string shadowVsPath;
+	string shadowGsPath;
+	string shadowFsPath;
+	thread loader;
+	mutex queueMutex;
+	condition_variable requestCV;
+	deque<string> requests;
+	vector<ReloadResult> completed;
+	bool quitting = false;
+};
+
+// Swap in a re-imported model: meshes whose data didn't change keep their buffers, the rest are re-uploaded.
+// Returns the number of meshes uploaded.
+int applyModelReload(ReloadResult &result, vector<MeshGL> &meshgls, vector<size_t> &meshHashes, vector<SceneNode> &nodes, SceneBVH &bvh);
@@ -7,20 +7,47 @@ in vec4 interPos;
 in vec3 interNormal;
 in vec2 interUV;
 in vec3 interTangent;
+in vec3 interWorldPos;
 
 struct PointLight {
 vec4 pos;
 vec4 color;
 };
 
-uniform PointLight light;
+// Per-frame constants (written into the uniform ring buffer once per frame)
+layout(std140, binding = 0) uniform FrameData {
+	mat4 viewMat;
+	mat4 projMat;
+	PointLight light;
+	float metallic;
+	float roughness;
+};
+
+// Per-draw constants (bound by offset into the uniform ring buffer for every draw)
+layout(std140, binding = 1) uniform DrawData {
+	mat4 modelMat;
+	mat4 normMat;
+};
 
-uniform float metallic;
-uniform float roughness;
+// Shadow constants (only rewritten when the shadow map is re-rendered)
+layout(std140, binding = 2) uniform ShadowData {
+	mat4 shadowMats[6];
+	vec4 shadowLightPos;
+	float shadowFar;
+	float shadowBias;
+	int shadowsEnabled;
+};
 const float PI = 3.14159265359;
 
-uniform sampler2D diffuseTexture;
-uniform sampler2D normalTexture;
+layout(binding = 0) uniform sampler2D diffuseTexture;
+layout(binding = 1) uniform sampler2D normalTexture;
+layout(binding = 2) uniform samplerCubeShadow shadowMap;
+
+// Directions of the PCF taps around the light-to-fragment direction
+const vec3 PCF_OFFSETS[8] = vec3[](
+	vec3( 1,  1,  1), vec3( 1, -1,  1), vec3(-1, -1,  1), vec3(-1,  1,  1),
+	vec3( 1,  1, -1), vec3( 1, -1, -1), vec3(-1, -1, -1), vec3(-1,  1, -1)
+);
 
 vec3 getFresnelAtAngleZero(vec3 albedo, float metallic)
 {
@@ -57,6 +84,27 @@ float getGF(vec3 L, vec3 V, vec3 N, float roughness)
 	return GL*GV;
 }
 
+// Fraction of the light reaching this fragment (1 = fully lit).
+// Each tap is a hardware depth comparison with bilinear filtering, so 8 taps filter a 4x4-ish footprint.
+float getShadow(vec3 worldPos, float NdotL)
+{
+	if(shadowsEnabled == 0) return 1.0;
+
+	vec3 toFrag = worldPos - vec3(shadowLightPos);
+	float dist = length(toFrag);
+	if(dist >= shadowFar) return 1.0;
+
+	// Bias grows at grazing angles, where depth changes fastest across a texel
+	float ref = dist / shadowFar - shadowBias * (1.0 + 2.0 * (1.0 - NdotL));
+	float spread = 1.5 * dist * 2.0 / float(textureSize(shadowMap, 0).x);
+
+	float lit = 0.0;
+	for(int i = 0; i < 8; i++) {
+		lit += texture(shadowMap, vec4(toFrag + PCF_OFFSETS[i] * spread, ref));
+	}
+	return lit / 8.0;
+}
+
 void main()
 {	
 	vec3 texColor = vec3(texture(diffuseTexture, interUV));
@@ -98,6 +146,8 @@ void main()
 	kS *= NDF * G;
 	kS /= (4.0 * max(0, dot(N,L)) * max(0, dot(N,V))) + 0.0001;
 
-	vec3 finalColor =  (kD + kS)*vec3(light.color)*max(0, dot(N,L));
+	float shadow = getShadow(interWorldPos, max(0, dot(normalize(interNormal), L)));
+
+	vec3 finalColor =  (kD + kS)*vec3(light.color)*max(0, dot(N,L))*shadow;
 	out_color = vec4(finalColor, 1.0);
 }
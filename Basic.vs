@@ -11,11 +11,27 @@ out vec4 interPos;
 out vec3 interNormal;
 out vec2 interUV;
 out vec3 interTangent;
-
-uniform mat3 normMat;
-uniform mat4 modelMat;
-uniform mat4 viewMat;
-uniform mat4 projMat;
+out vec3 interWorldPos;
+
+struct PointLight {
+vec4 pos;
+vec4 color;
+};
+
+// Per-frame constants (written into the uniform ring buffer once per frame)
+layout(std140, binding = 0) uniform FrameData {
+	mat4 viewMat;
+	mat4 projMat;
+	PointLight light;
+	float metallic;
+	float roughness;
+};
+
+// Per-draw constants (bound by offset into the uniform ring buffer for every draw)
+layout(std140, binding = 1) uniform DrawData {
+	mat4 modelMat;
+	mat4 normMat;
+};
 
 void main()
 {		
@@ -27,8 +43,11 @@ void main()
 	// interPos = model and view transforms
 	interPos = viewMat * modelMat * objPos;
 
+	// World-space position (for the shadow map lookup)
+	interWorldPos = vec3(modelMat * objPos);
+
 	// interNormal = normal transform
-	interNormal = normMat * normal;
+	interNormal = mat3(normMat) * normal;
 
 	// Output per-vertex color
 	vertexColor = color;
@@ -1,51 +1,130 @@
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <thread>
-#include <vector>
-#include <GL/glew.h>					
-#include <GLFW/glfw3.h>
-#include "glm/glm.hpp"
-#include <assimp/Importer.hpp>
-#include <assimp/scene.h>
-#include <assimp/postprocess.h>
-#include "glm/gtc/matrix_transform.hpp"
-#include "glm/gtx/transform.hpp"
-#define GLM_ENABLE_EXPERIMENTAL
-#include "glm/gtx/string_cast.hpp"
-#include "glm/gtc/type_ptr.hpp"
+#include "BasicGraphics.h"
+#include "SoftwareRasterizer.h"
+#include "ShadingKernel.h"
+#include "SceneBVH.h"
+#include "SceneStreamer.h"
+#include "AssetReloader.h"
+#include "FrameCapture.h"
+
+// stb_image allocations go through the load arena (see stbiArenaMalloc below)
+void* stbiArenaMalloc(size_t size);
+void* stbiArenaRealloc(void *p, size_t newSize);
+void stbiArenaFree(void *p);
+#define STBI_MALLOC(sz) stbiArenaMalloc(sz)
+#define STBI_REALLOC(p,newsz) stbiArenaRealloc(p,newsz)
+#define STBI_FREE(p) stbiArenaFree(p)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
 
-using namespace std;
 
-// Struct for holding vertex data
-struct Vertex {
-	glm::vec3 position;
-	glm::vec4 color;
-	glm::vec3 normal;
-	glm::vec2 texcoords;
-	glm::vec3 tangent;
-};
+// Names of the memory categories, in MemCategory order
+const char *MEM_CATEGORY_NAMES[MEM_CATEGORY_CNT] = { "vertex", "index", "texture", "uniform", "staging", "bvh" };
+
+MemCounter memCounters[MEM_LOCATION_CNT][MEM_CATEGORY_CNT];
+
+// Record an allocation of bytes
+void trackAlloc(MemLocation location, MemCategory category, long long bytes) {
+	MemCounter &counter = memCounters[location][category];
+	long long current = counter.current.fetch_add(bytes) + bytes;
+	long long peak = counter.peak.load();
+	while(current > peak && !counter.peak.compare_exchange_weak(peak, current)) {}
+}
+
+// Record a free of bytes
+void trackFree(MemLocation location, MemCategory category, long long bytes) {
+	memCounters[location][category].current.fetch_sub(bytes);
+}
+
+// Print out current and peak usage of every category
+void printMemoryStats() {
+	const char *locationNames[MEM_LOCATION_CNT] = { "Host", "GPU" };
+	cout << "** MEMORY **" << endl;
+	for(int loc = 0; loc < MEM_LOCATION_CNT; loc++) {
+		long long totalCurrent = 0;
+		for(int cat = 0; cat < MEM_CATEGORY_CNT; cat++) {
+			MemCounter &counter = memCounters[loc][cat];
+			totalCurrent += counter.current.load();
+			cout << locationNames[loc] << " " << MEM_CATEGORY_NAMES[cat] << ": ";
+			cout << counter.current.load() << " bytes (peak " << counter.peak.load() << ")" << endl;
+		}
+		cout << locationNames[loc] << " total: " << totalCurrent << " bytes" << endl;
+	}
+}
+
+// Number of heap allocations made through TrackedAllocator, stb_image and Arena blocks (for load statistics)
+atomic<unsigned long> heapAllocCnt{0};
+
+// Arena used for scratch allocations on this thread while loading (null = use the heap)
+thread_local Arena *loadArena = nullptr;
+
+// stb_image allocation hooks; arena allocations keep their size in front so realloc can copy them
+void* stbiArenaMalloc(size_t size) {
+	if(!loadArena) {
+		heapAllocCnt++;
+		return malloc(size);
+	}
+	unsigned char *p = (unsigned char*)loadArena->allocate(size + 16);
+	*(size_t*)p = size;
+	return p + 16;
+}
+
+void* stbiArenaRealloc(void *p, size_t newSize) {
+	if(!p) return stbiArenaMalloc(newSize);
+	if(loadArena && loadArena->owns(p)) {
+		size_t oldSize = *(size_t*)((unsigned char*)p - 16);
+		void *newP = stbiArenaMalloc(newSize);
+		memcpy(newP, p, min(oldSize, newSize));
+		return newP;
+	}
+	heapAllocCnt++;
+	return realloc(p, newSize);
+}
 
-// Struct for holding mesh data
-struct Mesh {
-	vector<Vertex> vertices;
-	vector<unsigned int> indices;
+void stbiArenaFree(void *p) {
+	if(loadArena && loadArena->owns(p)) return;
+	free(p);
+}
+
+// Number of frames the uniform ring buffer keeps in flight
+const int UNIFORM_RING_FRAMES = 3;
+
+// Struct for holding the uniform ring buffer.
+// The buffer is split into one region per in-flight frame; a fence per region tells us when the GPU is done reading it.
+struct UniformRing {
+	GLuint buffer = 0;
+	unsigned char *mapped = nullptr;	// Persistent mapping (null if glBufferStorage is unavailable)
+	vector<unsigned char, TrackedAllocator<unsigned char, MEM_STAGING>> staging;		// Copy of the current region when we can't map persistently
+	GLsizeiptr regionSize = 0;
+	GLint alignment = 256;
+	int region = 0;
+	GLsizeiptr used = 0;
+	GLsync fences[UNIFORM_RING_FRAMES] = {};
 };
 
-// Struct for holding OpenGL mesh
-struct MeshGL {
-	GLuint VBO = 0;
-	GLuint EBO = 0;
-	GLuint VAO = 0;
-	int indexCnt = 0;
+// Struct for holding shadow constants (matches the std140 ShadowData block in the shaders)
+struct ShadowUniforms {
+	glm::mat4 faceMats[6];		// View-projection of every cube face
+	glm::vec4 lightPos;			// World space
+	float farPlane;
+	float bias;
+	int enabled;
+	float padding;
 };
 
-// Struct for holding PointLight mesh
-struct PointLight {
-	glm::vec4 pos;
-	glm::vec4 color;
+// Struct for holding the cube shadow map of the point light.
+// It is cached: re-rendered only when the light or a shadow caster within farPlane of it moves.
+struct ShadowMap {
+	GLuint depthCube = 0;
+	GLuint fbo = 0;
+	GLuint uniformBuffer = 0;
+	int size = 1024;
+	float farPlane = 25.0f;
+	bool valid = false;
+	glm::vec3 lightPos;						// Light position it was rendered for
+	vector<glm::mat4> casterMats;			// Node world matrices it was rendered with
+	unsigned long renders = 0;
 };
 
 //Global Variables
@@ -60,6 +139,18 @@ glm::vec2 mousePos;
 float metallic = 0.0;
 float roughness = 0.1;
 
+bool showStats = false;
+
+// Set whenever something that affects the rendered image changes (--on-demand only draws when it is set)
+bool sceneDirty = true;
+
+bool pickRequested = false;
+glm::vec2 pickPos;
+
+// F12 saves a screenshot, R starts/stops recording
+bool screenshotRequested = false;
+bool recordToggleRequested = false;
+
 //Debugging Functions
 void aiMatToGLM4(aiMatrix4x4 &a, glm::mat4 &m) {
 	for(int i = 0; i < 4; i++) {
@@ -101,11 +192,24 @@ string readFileToString(string filename) {
 		throw runtime_error(m);
 	}
 
-	// Create output stream to receive file data
-	ostringstream outS;
-	outS << file.rdbuf();
-	// Get actual string of file contents
-	string allS = outS.str();
+	// Read file straight into a string of the right size
+	file.seekg(0, ios::end);
+	streamoff size = file.tellg();
+	string allS;
+	if(size >= 0) {
+		allS.resize((size_t)size);
+		file.seekg(0, ios::beg);
+		file.read(&allS[0], allS.size());
+		// Keep only what was actually read (text mode may translate line endings)
+		allS.resize(file.gcount());
+	}
+	else {
+		// Can't seek (e.g. a pipe): read it through a string stream instead
+		file.clear();
+		ostringstream outS;
+		outS << file.rdbuf();
+		allS = outS.str();
+	}
 	// Close file
 	file.close();
 	// Return string
@@ -407,6 +511,45 @@ GLuint initShaderProgramFromSource(string vertexShaderCode, string fragmentShade
 	return programID;
 }
 
+// Same as above, with a geometry shader between the vertex and fragment shaders
+GLuint initShaderProgramFromSource(string vertexShaderCode, string geometryShaderCode, string fragmentShaderCode) {
+	GLuint vertID = 0;
+	GLuint geomID = 0;
+	GLuint fragID = 0;
+	GLuint programID = 0;
+
+	try {
+		// Create and compile shaders
+		cout << "Vertex shader: ";
+		vertID = createAndCompileShader(vertexShaderCode.c_str(), GL_VERTEX_SHADER);
+		cout << "Geometry shader: ";
+		geomID = createAndCompileShader(geometryShaderCode.c_str(), GL_GEOMETRY_SHADER);
+		cout << "Fragment shader: ";
+		fragID = createAndCompileShader(fragmentShaderCode.c_str(), GL_FRAGMENT_SHADER);
+
+		// Create and link program
+		programID = createAndLinkShaderProgram({ vertID, geomID, fragID });
+
+		// Delete individual shaders
+		glDeleteShader(vertID);
+		glDeleteShader(geomID);
+		glDeleteShader(fragID);
+
+		// Success!
+		cout << "Program successfully compiled and linked!" << endl;
+	}
+	catch (exception e) {
+		// Cleanup shaders and shader program, just in case
+		if (vertID) glDeleteShader(vertID);
+		if (geomID) glDeleteShader(geomID);
+		if (fragID) glDeleteShader(fragID);		
+		// Rethrow exception
+		throw e;
+	}
+
+	return programID;
+}
+
 // Create very simple mesh: a quad (4 vertices, 6 indices, 2 triangles)
 void createSimpleQuad(Mesh &m) {
 	// Clear out vertices and elements
@@ -497,6 +640,7 @@ static void mouse_position_callback(GLFWwindow* window, double xpos, double ypos
 		glm::vec4 lookAtV = glm::vec4(lookAt, 1.0);
 		lookAtV = relymot * relxmot * lookAtV;
 		lookAt = glm::vec3(lookAtV);
+		if(xmov != 0 || ymov != 0) sceneDirty = true;
     }
 
 	mousePos[0] = xpos;
@@ -504,6 +648,25 @@ static void mouse_position_callback(GLFWwindow* window, double xpos, double ypos
 	//glfwSetCursorPos(window, 0, 0); 
 }
 
+// Mouse Button Callback (left click selects whatever is under the cursor)
+static void mouse_button_callback(GLFWwindow* window, int button, int action, int mods) {
+	if(button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
+		double xpos, ypos;
+		glfwGetCursorPos(window, &xpos, &ypos);
+		pickPos = glm::vec2(xpos, ypos);
+		pickRequested = true;
+	}
+}
+
+// Framebuffer size and window refresh callbacks (the image has to be redrawn)
+static void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
+	sceneDirty = true;
+}
+
+static void window_refresh_callback(GLFWwindow* window) {
+	sceneDirty = true;
+}
+
 // Key Callbacks
 static void key_callback(GLFWwindow *window,
                         int key,
@@ -518,51 +681,76 @@ static void key_callback(GLFWwindow *window,
 			glm::vec3 direction = (lookAt - eye) * glm::vec3(0.1, 0.1, 0.1);
 			lookAt += direction;
 			eye += direction;
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_A) {
 			glm::vec3 direction = (glm::cross(eye - lookAt, glm::vec3(0,1,0))) * glm::vec3(0.1, 0.1, 0.1);
 			lookAt += direction;
 			eye += direction;
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_S) {
 			glm::vec3 direction = (eye - lookAt) * glm::vec3(0.1, 0.1, 0.1);
 			lookAt += direction;
 			eye += direction;
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_D) {
 			glm::vec3 direction = (glm::cross(glm::vec3(0,1,0), eye - lookAt)) * glm::vec3(0.1, 0.1, 0.1);
 			lookAt += direction;
 			eye += direction;
+			sceneDirty = true;
 		}
         else if(key == GLFW_KEY_J) {
 			rotAngle += 1.0;
+			sceneDirty = true;
         }
         else if(key == GLFW_KEY_K) {
 			rotAngle -= 1.0;
+			sceneDirty = true;
         }
 		else if(key == GLFW_KEY_1) {
 			light.color = glm::vec4(1.0,1.0,1.0,1.0);
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_2) {
 			light.color = glm::vec4(1.0,0.0,0.0,1.0);
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_3) {
 			light.color = glm::vec4(0.0,1.0,0.0,1.0);
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_4) {
 			light.color = glm::vec4(0.0,0.0,1.0,1.0);
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_V) {
 			metallic = max(0.0, metallic - 0.1);
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_B) {
 			metallic = min(1.0, metallic + 0.1);
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_N) {
 			roughness = max(0.1, roughness - 0.1);
+			sceneDirty = true;
 		}
 		else if(key == GLFW_KEY_M) {
 			roughness = min(0.7, roughness + 0.1);
+			sceneDirty = true;
+		}
+		else if(key == GLFW_KEY_P) {
+			showStats = true;
+		}
+		else if(key == GLFW_KEY_F12) {
+			screenshotRequested = true;
+			sceneDirty = true;
+		}
+		else if(key == GLFW_KEY_R) {
+			recordToggleRequested = true;
+			sceneDirty = true;
 		}
     }
 }
@@ -571,6 +759,14 @@ void extractMeshData(aiMesh *mesh, Mesh &m) {
 	// Clear out vertices and elements
 	m.vertices.clear();
 	m.indices.clear();
+
+	// Size vectors up front so they're allocated once
+	int indexCnt = 0;
+	for (int i = 0; i < mesh->mNumFaces; i++) {
+		indexCnt += mesh->mFaces[i].mNumIndices;
+	}
+	m.vertices.reserve(mesh->mNumVertices);
+	m.indices.reserve(indexCnt);
 	
 	// Loop through meshes
 	for (int i = 0; i < mesh->mNumVertices; i++) {
@@ -596,6 +792,14 @@ void extractMeshData(aiMesh *mesh, Mesh &m) {
 
 // Create OpenGL mesh (VAO) from mesh data
 void createMeshGL(Mesh &m, MeshGL &mgl) {
+	// Object-space bounds (used to tell which nodes can cast shadows)
+	mgl.boundsMin = glm::vec3(numeric_limits<float>::max());
+	mgl.boundsMax = glm::vec3(-numeric_limits<float>::max());
+	for(Vertex &v : m.vertices) {
+		mgl.boundsMin = glm::min(mgl.boundsMin, v.position);
+		mgl.boundsMax = glm::max(mgl.boundsMax, v.position);
+	}
+
 	// Create Vertex Buffer Object (VBO)
 	glGenBuffers(1, &(mgl.VBO));
 	glBindBuffer(GL_ARRAY_BUFFER, mgl.VBO);
@@ -637,13 +841,113 @@ void createMeshGL(Mesh &m, MeshGL &mgl) {
 		m.indices.data(),
 		GL_STATIC_DRAW);
 
-	// Set index count
+	// Set vertex and index counts
+	mgl.vertexCnt = (int)m.vertices.size();
 	mgl.indexCnt = (int)m.indices.size();
+	trackAlloc(MEM_GPU, MEM_VERTEX, sizeof(Vertex)*mgl.vertexCnt);
+	trackAlloc(MEM_GPU, MEM_INDEX, sizeof(GLuint)*mgl.indexCnt);
 
 	// Unbind vertex array for now
 	glBindVertexArray(0);
 }
 
+// Round size up to the uniform buffer offset alignment
+GLsizeiptr alignUniformSize(UniformRing &ring, GLsizeiptr size) {
+	return (size + ring.alignment - 1) / ring.alignment * ring.alignment;
+}
+
+// Create uniform ring buffer with room for bytesPerFrame of constants in every region
+// (ring.alignment should already hold GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT)
+void createUniformRing(UniformRing &ring, GLsizeiptr bytesPerFrame) {
+	ring.regionSize = alignUniformSize(ring, bytesPerFrame);
+	GLsizeiptr totalSize = ring.regionSize * UNIFORM_RING_FRAMES;
+
+	glGenBuffers(1, &(ring.buffer));
+	glBindBuffer(GL_UNIFORM_BUFFER, ring.buffer);
+	if(GLEW_ARB_buffer_storage) {
+		// Map once and keep it mapped; coherent so no explicit flushes are needed
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_UNIFORM_BUFFER, totalSize, nullptr, flags);
+		ring.mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, totalSize, flags);
+		if(!ring.mapped) {
+			cout << "Error mapping uniform ring buffer." << endl;
+			throw runtime_error("Error mapping uniform ring buffer.");
+		}
+	}
+	else {
+		cout << "WARNING: glBufferStorage not supported; uniform ring buffer will use glBufferSubData" << endl;
+		glBufferData(GL_UNIFORM_BUFFER, totalSize, nullptr, GL_DYNAMIC_DRAW);
+		ring.staging.resize(ring.regionSize);
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	trackAlloc(MEM_GPU, MEM_UNIFORM, totalSize);
+}
+
+// Move to the next region, waiting only if the GPU is still reading it from UNIFORM_RING_FRAMES frames ago
+void beginUniformFrame(UniformRing &ring) {
+	ring.region = (ring.region + 1) % UNIFORM_RING_FRAMES;
+	ring.used = 0;
+
+	GLsync &fence = ring.fences[ring.region];
+	if(fence) {
+		GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		while(result == GL_TIMEOUT_EXPIRED) {
+			result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		}
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+}
+
+// Reserve size bytes in the current region; returns the offset into the buffer (for glBindBufferRange)
+GLintptr allocUniforms(UniformRing &ring, GLsizeiptr size) {
+	GLsizeiptr alignedSize = alignUniformSize(ring, size);
+	if(ring.used + alignedSize > ring.regionSize) {
+		throw runtime_error("Uniform ring buffer region is full.");
+	}
+	GLintptr offset = ring.region*ring.regionSize + ring.used;
+	ring.used += alignedSize;
+	return offset;
+}
+
+// Get CPU pointer for writing constants at an offset returned by allocUniforms
+unsigned char* uniformPtr(UniformRing &ring, GLintptr offset) {
+	if(ring.mapped) return ring.mapped + offset;
+	return ring.staging.data() + (offset - ring.region*ring.regionSize);
+}
+
+// Make this frame's constants visible to the GPU (only needed without a persistent mapping)
+void flushUniformFrame(UniformRing &ring) {
+	if(ring.mapped || ring.used == 0) return;
+	glBindBuffer(GL_UNIFORM_BUFFER, ring.buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, ring.region*ring.regionSize, ring.used, ring.staging.data());
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// Fence the current region once all draws reading from it have been issued
+void endUniformFrame(UniformRing &ring) {
+	ring.fences[ring.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Cleanup uniform ring buffer
+void cleanupUniformRing(UniformRing &ring) {
+	for(int i = 0; i < UNIFORM_RING_FRAMES; i++) {
+		if(ring.fences[i]) glDeleteSync(ring.fences[i]);
+		ring.fences[i] = nullptr;
+	}
+
+	if(ring.mapped) {
+		glBindBuffer(GL_UNIFORM_BUFFER, ring.buffer);
+		glUnmapBuffer(GL_UNIFORM_BUFFER);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		ring.mapped = nullptr;
+	}
+
+	glDeleteBuffers(1, &(ring.buffer));
+	ring.buffer = 0;
+	trackFree(MEM_GPU, MEM_UNIFORM, ring.regionSize * UNIFORM_RING_FRAMES);
+}
+
 // Draw OpenGL mesh
 void drawMesh(MeshGL &mgl) {
 	glBindVertexArray(mgl.VAO);
@@ -651,71 +955,368 @@ void drawMesh(MeshGL &mgl) {
 	glBindVertexArray(0);		
 }
 
-unsigned int loadAndCreateTexture(string filename) {
-    int twidth, theight, tnumc;
+// Free the pixels (and their staging count)
+void TextureImage::release() {
+    if(pixels) {
+        stbi_image_free(pixels);
+        trackFree(MEM_HOST, MEM_STAGING, trackedBytes);
+        pixels = nullptr;
+        trackedBytes = 0;
+    }
+}
+
+// Decode a texture file into CPU memory; safe to call from any thread.
+// Returns false (after printing why) if the file can't be used as a texture.
+bool decodeTexture(string filename, TextureImage &image) {
+    image.release();
     stbi_set_flip_vertically_on_load(1);
-    unsigned char* tex_image = stbi_load(filename.c_str(), &twidth, &theight, &tnumc, 0);
+    image.pixels = stbi_load(filename.c_str(), &image.width, &image.height, &image.channels, 0);
 
-    if(!tex_image) {
+    if(!image.pixels) {
         cout << "COULD NOT LOAD TEXTURE: " << filename << endl;
-        glfwTerminate();
-        exit(1);
+        return false;
+    }
+    if(!(loadArena && loadArena->owns(image.pixels))) {
+        image.trackedBytes = (long long)image.width*image.height*image.channels;
+        trackAlloc(MEM_HOST, MEM_STAGING, image.trackedBytes);
     }
 
+    if(image.channels != 3 && image.channels != 4) {
+        cout << "UNKNOWN NUMBER OF CHANNELS: " << image.channels << endl;
+        image.release();
+        return false;
+    }
+    return true;
+}
+
+// Bytes counted for each texture created by createTextureFromImage, so cleanupTexture frees exactly that much
+map<unsigned int, long long> textureBytes;
+
+// Upload a decoded texture (render thread only); the CPU copy is freed afterwards
+unsigned int createTextureFromImage(TextureImage &image) {
     GLenum format;
-    if(tnumc == 3) {
+    if(image.channels == 3) {
         format = GL_RGB;
         glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     }
-    else if(tnumc == 4) {
-        format = GL_RGBA;
-    }
     else {
-        cout << "UNKNOWN NUMBER OF CHANNELS: " << tnumc << endl;
-        glfwTerminate();
-        exit(1);
+        format = GL_RGBA;
     }
 
     unsigned int textureID = 0;
     glGenTextures(1, &textureID);
     glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, format, twidth, theight, 0, format, 
-                    GL_UNSIGNED_BYTE, tex_image);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, 
+                    GL_UNSIGNED_BYTE, image.pixels);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    stbi_image_free(tex_image);
+    long long bytes = (long long)image.width*image.height*image.channels;
+    textureBytes[textureID] = bytes;
+    trackAlloc(MEM_GPU, MEM_TEXTURE, bytes);
+    image.release();
 
     return textureID;
 }
 
-void renderScene(vector<MeshGL> &allMeshes,
-				aiNode *node,
-				glm::mat4 parentMat,
-				GLint modelMatLoc,
-				GLint normMatLoc,
-				glm::mat4 viewMat,
-				int level) {
-	aiMatrix4x4 transformation = node->mTransformation;
+unsigned int loadAndCreateTexture(string filename) {
+    TextureImage image;
+    if(!decodeTexture(filename, image)) {
+        glfwTerminate();
+        exit(1);
+    }
+    return createTextureFromImage(image);
+}
+
+// Cleanup texture (frees the bytes textureBytes says were counted when it was created)
+void cleanupTexture(unsigned int &textureID) {
+    map<unsigned int, long long>::iterator it = textureBytes.find(textureID);
+    if(it != textureBytes.end()) {
+        trackFree(MEM_GPU, MEM_TEXTURE, it->second);
+        textureBytes.erase(it);
+    }
+
+    glDeleteTextures(1, &textureID);
+    textureID = 0;
+}
+
+// Walk the aiNode hierarchy once and store the accumulated transform of every node that has meshes.
+// Node transforms never change after loading, so this propagation doesn't need to happen per frame.
+void flattenScene(aiNode *node, glm::mat4 parentMat, vector<SceneNode> &nodes) {
 	glm::mat4 nodeT;
-	aiMatToGLM4(transformation, nodeT);
+	aiMatToGLM4(node->mTransformation, nodeT);
 	glm::mat4 modelMat = parentMat*nodeT;
-	glm::mat4 R = makeRotateZ(modelMat[3]);
 
-	glm::mat4 tmpModel = R * modelMat;
-	glUniformMatrix4fv(modelMatLoc, 1, false, glm::value_ptr(tmpModel));
+	if(node->mNumMeshes > 0) {
+		SceneNode sn;
+		sn.modelMat = modelMat;
+		for(int i = 0; i < node->mNumMeshes; i++) {
+			sn.meshIndices.push_back(node->mMeshes[i]);
+		}
+		nodes.push_back(sn);
+	}
 
-	glm::mat3 normMat = glm::transpose(glm::inverse(glm::mat3(viewMat * tmpModel)));
-	glUniformMatrix3fv(normMatLoc, 1, false, glm::value_ptr(normMat));
-	for(int i = 0; i < node->mNumMeshes; i++){
-		int index = node->mMeshes[i];
-		drawMesh(allMeshes.at(index));
+	for(int i = 0; i < node->mNumChildren; i++) {
+		flattenScene(node->mChildren[i], modelMat, nodes);
 	}
-	for(int i = 0; i < node->mNumChildren; i++){
-		renderScene(allMeshes, node->mChildren[i], modelMat, modelMatLoc, normMatLoc, viewMat, level + 1);
+}
+
+// World matrix of a scene node this frame (its load-time transform plus the J/K rotation)
+glm::mat4 nodeWorldMatrix(SceneNode &node) {
+	glm::mat4 R = makeRotateZ(node.modelMat[3]);
+	return R * node.modelMat;
+}
+
+void writeDrawUniforms(glm::mat4 worldMat, glm::mat4 viewMat, DrawUniforms *draw) {
+	glm::mat3 normMat = glm::transpose(glm::inverse(glm::mat3(viewMat * worldMat)));
+	draw->modelMat = worldMat;
+	draw->normMat = glm::mat4(normMat);
+}
+
+void buildDrawList(vector<SceneNode> &nodes, vector<MeshGL> &allMeshes, glm::mat4 viewMat, glm::mat4 projMat, int viewportHeight,
+					unsigned char *drawData, GLsizeiptr stride, DrawList &list, WorkerPool &pool) {
+	// Every mesh of every node gets a fixed number, so equal depths always sort the same way
+	vector<int> firstItem(nodes.size());
+	int itemCnt = 0;
+	for(int i = 0; i < nodes.size(); i++) {
+		firstItem[i] = itemCnt;
+		itemCnt += (int)nodes[i].meshIndices.size();
+	}
+	list.worldMats.resize(nodes.size());
+	list.items.resize(itemCnt);
+
+	// World-space frustum planes (a point p is inside plane k if dot(planes[k], vec4(p, 1)) >= 0)
+	glm::mat4 viewProj = projMat * viewMat;
+	glm::vec4 planes[6];
+	for(int k = 0; k < 3; k++) {
+		glm::vec4 row(viewProj[0][k], viewProj[1][k], viewProj[2][k], viewProj[3][k]);
+		glm::vec4 rowW(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+		planes[k*2] = rowW + row;
+		planes[k*2 + 1] = rowW - row;
+	}
+	// Size in pixels of something 1 unit across at view depth 1
+	float pixelScale = projMat[1][1] * viewportHeight * 0.5f;
+
+	atomic<int> visibleCnt{0};
+	atomic<int> culledCnt{0};
+	atomic<int> tooSmallCnt{0};
+	pool.parallelFor((int)nodes.size(), [&](int i) {
+		glm::mat4 worldMat = nodeWorldMatrix(nodes[i]);
+		list.worldMats[i] = worldMat;
+		writeDrawUniforms(worldMat, viewMat, (DrawUniforms*)(drawData + i*stride));
+
+		// Maps a box's half size to the half size of the world-space box around it
+		glm::mat3 absWorld = glm::mat3(glm::abs(glm::vec3(worldMat[0])), glm::abs(glm::vec3(worldMat[1])), glm::abs(glm::vec3(worldMat[2])));
+		for(int k = 0; k < nodes[i].meshIndices.size(); k++) {
+			int index = nodes[i].meshIndices[k];
+			MeshGL &mgl = allMeshes.at(index);
+			if(mgl.VAO == 0) continue;
+
+			glm::vec3 center = glm::vec3(worldMat * glm::vec4((mgl.boundsMin + mgl.boundsMax) * 0.5f, 1.0));
+			glm::vec3 halfSize = absWorld * ((mgl.boundsMax - mgl.boundsMin) * 0.5f);
+			bool outside = false;
+			for(glm::vec4 &plane : planes) {
+				glm::vec3 normal = glm::vec3(plane);
+				if(glm::dot(normal, center) + plane.w + glm::dot(glm::abs(normal), halfSize) < 0.0f) {
+					outside = true;
+					break;
+				}
+			}
+			if(outside) {
+				culledCnt++;
+				continue;
+			}
+
+			// Level of detail: the models have no simplified meshes, so the only level below the full mesh is none
+			float depth = -(viewMat * glm::vec4(center, 1.0)).z;
+			float radius = glm::length(halfSize);
+			if(depth > radius && 2.0f*radius*pixelScale < MIN_DRAW_PIXELS*depth) {
+				tooSmallCnt++;
+				continue;
+			}
+
+			// Non-negative floats order the same as their bit patterns
+			float keyDepth = max(depth, 0.0f);
+			unsigned int depthBits;
+			memcpy(&depthBits, &keyDepth, sizeof(depthBits));
+			DrawItem &item = list.items[visibleCnt++];
+			item.sortKey = ((unsigned long long)depthBits << 32) | (unsigned int)(firstItem[i] + k);
+			item.node = i;
+			item.mesh = index;
+		}
+	});
+
+	// Front to back, so that depth testing rejects hidden fragments before they are shaded
+	// (every mesh uses the same program and textures, so there is no other state worth sorting by)
+	list.items.resize(visibleCnt);
+	sort(list.items.begin(), list.items.end(), [](const DrawItem &a, const DrawItem &b) { return a.sortKey < b.sortKey; });
+	list.culledCnt = culledCnt;
+	list.tooSmallCnt = tooSmallCnt;
+}
+
+// Replay the draw list on the OpenGL thread, binding each node's constants by offset
+void renderDrawList(vector<MeshGL> &allMeshes,
+					DrawList &list,
+					GLuint uniformBuffer,
+					GLintptr drawOffset,
+					GLsizeiptr stride) {
+	int boundNode = -1;
+	for(DrawItem &item : list.items) {
+		if(item.node != boundNode) {
+			glBindBufferRange(GL_UNIFORM_BUFFER, 1, uniformBuffer, drawOffset + item.node*stride, sizeof(DrawUniforms));
+			boundNode = item.node;
+		}
+		drawMesh(allMeshes.at(item.mesh));
+	}
+}
+
+// Draw every resident mesh of every node, visible or not (for the shadow map, which sees the whole scene)
+void renderScene(vector<MeshGL> &allMeshes,
+				vector<SceneNode> &nodes,
+				GLuint uniformBuffer,
+				GLintptr drawOffset,
+				GLsizeiptr stride) {
+	for(int i = 0; i < nodes.size(); i++) {
+		glBindBufferRange(GL_UNIFORM_BUFFER, 1, uniformBuffer, drawOffset + i*stride, sizeof(DrawUniforms));
+		for(int index : nodes[i].meshIndices) {
+			// Skip meshes that aren't resident (streaming mode)
+			if(allMeshes.at(index).VAO == 0) continue;
+			drawMesh(allMeshes.at(index));
+		}
+	}
+}
+
+// Create the cube depth texture and its layered framebuffer
+void createShadowDepth(ShadowMap &shadow) {
+	glGenTextures(1, &(shadow.depthCube));
+	glBindTexture(GL_TEXTURE_CUBE_MAP, shadow.depthCube);
+	glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, GL_DEPTH_COMPONENT24, shadow.size, shadow.size);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	// Hardware depth comparison (bilinear PCF for every lookup)
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	// Attach the whole cube (layered), so the geometry shader can pick the face with gl_Layer
+	glGenFramebuffers(1, &(shadow.fbo));
+	glBindFramebuffer(GL_FRAMEBUFFER, shadow.fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow.depthCube, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if(status != GL_FRAMEBUFFER_COMPLETE) {
+		// Leave nothing behind, so depthCube == 0 still means "no depth cube"
+		glDeleteFramebuffers(1, &(shadow.fbo));
+		shadow.fbo = 0;
+		glDeleteTextures(1, &(shadow.depthCube));
+		shadow.depthCube = 0;
+		cout << "Error creating shadow map framebuffer." << endl;
+		throw runtime_error("Error creating shadow map framebuffer.");
+	}
+	trackAlloc(MEM_GPU, MEM_TEXTURE, (long long)shadow.size*shadow.size*6*4);
+}
+
+// Create the shadow uniform buffer and, if withDepth, the depth cube and framebuffer
+// (Basic.fs always reads the uniforms, but only samples the cube once they are enabled)
+void createShadowMap(ShadowMap &shadow, bool withDepth) {
+	if(withDepth) createShadowDepth(shadow);
+
+	// Starts out disabled until the first render
+	ShadowUniforms uniforms = {};
+	glGenBuffers(1, &(shadow.uniformBuffer));
+	glBindBuffer(GL_UNIFORM_BUFFER, shadow.uniformBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(ShadowUniforms), &uniforms, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	trackAlloc(MEM_GPU, MEM_UNIFORM, sizeof(ShadowUniforms));
+}
+
+// Does the cached shadow map need to be re-rendered?
+// Moved nodes only count if they are (or were) within farPlane of the light; the others just update the cache.
+bool shadowMapNeedsUpdate(ShadowMap &shadow, glm::vec3 lightPos, vector<SceneNode> &nodes, vector<glm::mat4> &worldMats, vector<MeshGL> &allMeshes) {
+	if(!shadow.valid || glm::length(lightPos - shadow.lightPos) > 1e-5f || shadow.casterMats.size() != nodes.size()) {
+		return true;
+	}
+
+	bool casterMoved = false;
+	for(int i = 0; i < nodes.size(); i++) {
+		glm::mat4 &worldMat = worldMats[i];
+		glm::mat4 &oldMat = shadow.casterMats[i];
+		if(worldMat == oldMat) continue;
+
+		// Bounding sphere of the node's meshes, before and after the move
+		for(int index : nodes[i].meshIndices) {
+			MeshGL &mgl = allMeshes.at(index);
+			if(mgl.VAO == 0) continue;
+			glm::vec3 center = (mgl.boundsMin + mgl.boundsMax) * 0.5f;
+			float extent = glm::length(mgl.boundsMax - mgl.boundsMin) * 0.5f;
+			for(glm::mat4 *M : { &worldMat, &oldMat }) {
+				float scale = max(glm::length(glm::vec3((*M)[0])), max(glm::length(glm::vec3((*M)[1])), glm::length(glm::vec3((*M)[2]))));
+				glm::vec3 worldCenter = glm::vec3(*M * glm::vec4(center, 1.0));
+				if(glm::length(worldCenter - lightPos) - extent*scale < shadow.farPlane) casterMoved = true;
+			}
+		}
+		oldMat = worldMat;
+	}
+	return casterMoved;
+}
+
+// Render all six faces of the shadow map in one pass (per-draw constants must already be in the uniform buffer,
+// and worldMats are the world matrices they were made from)
+void renderShadowMap(ShadowMap &shadow, GLuint shadowProgramID, glm::vec3 lightPos,
+					vector<MeshGL> &allMeshes, vector<SceneNode> &nodes, vector<glm::mat4> &worldMats,
+					GLuint uniformBuffer, GLintptr drawOffset, GLsizeiptr stride) {
+	// Face orientations follow the cube map convention
+	const glm::vec3 faceDirs[6] = { glm::vec3(1,0,0), glm::vec3(-1,0,0), glm::vec3(0,1,0), glm::vec3(0,-1,0), glm::vec3(0,0,1), glm::vec3(0,0,-1) };
+	const glm::vec3 faceUps[6] = { glm::vec3(0,-1,0), glm::vec3(0,-1,0), glm::vec3(0,0,1), glm::vec3(0,0,-1), glm::vec3(0,-1,0), glm::vec3(0,-1,0) };
+
+	ShadowUniforms uniforms;
+	glm::mat4 shadowProj = glm::perspective(glm::radians(90.0), 1.0, 0.05, (double)shadow.farPlane);
+	for(int i = 0; i < 6; i++) {
+		uniforms.faceMats[i] = shadowProj * glm::lookAt(lightPos, lightPos + faceDirs[i], faceUps[i]);
+	}
+	uniforms.lightPos = glm::vec4(lightPos, 1.0);
+	uniforms.farPlane = shadow.farPlane;
+	uniforms.bias = 0.0015f;
+	uniforms.enabled = 1;
+	uniforms.padding = 0.0f;
+	glBindBuffer(GL_UNIFORM_BUFFER, shadow.uniformBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ShadowUniforms), &uniforms);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 2, shadow.uniformBuffer);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, shadow.fbo);
+	glViewport(0, 0, shadow.size, shadow.size);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glUseProgram(shadowProgramID);
+	renderScene(allMeshes, nodes, uniformBuffer, drawOffset, stride);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	// Remember what this was rendered for
+	shadow.lightPos = lightPos;
+	shadow.casterMats = worldMats;
+	shadow.valid = true;
+	shadow.renders++;
+}
+
+// Cleanup shadow map
+void cleanupShadowMap(ShadowMap &shadow) {
+	if(shadow.depthCube != 0) {
+		glDeleteFramebuffers(1, &(shadow.fbo));
+		shadow.fbo = 0;
+		glDeleteTextures(1, &(shadow.depthCube));
+		shadow.depthCube = 0;
+		trackFree(MEM_GPU, MEM_TEXTURE, (long long)shadow.size*shadow.size*6*4);
 	}
+	glDeleteBuffers(1, &(shadow.uniformBuffer));
+	shadow.uniformBuffer = 0;
+	trackFree(MEM_GPU, MEM_UNIFORM, sizeof(ShadowUniforms));
 }
 
 // Cleanup OpenGL mesh
@@ -733,6 +1334,9 @@ void cleanupMesh(MeshGL &mgl) {
 	glDeleteVertexArrays(1, &(mgl.VAO));
 	mgl.VAO = 0;
 
+	trackFree(MEM_GPU, MEM_VERTEX, sizeof(Vertex)*mgl.vertexCnt);
+	trackFree(MEM_GPU, MEM_INDEX, sizeof(GLuint)*mgl.indexCnt);
+	mgl.vertexCnt = 0;
 	mgl.indexCnt = 0;
 }
 
@@ -744,17 +1348,112 @@ int main(int argc, char **argv) {
 		throw std::invalid_argument("No argument entered");
 	}
 	
+	// Check batched shading kernel against scalar reference (no model needed)
+	if (string(argv[1]) == "--shading-test") {
+		light.pos =  glm::vec4(0.5, 0.5, 0.5, 1.0);
+		light.color =  glm::vec4(1.0, 1.0, 1.0, 1.0);
+		return runShadingTest(argc > 2 ? stoi(argv[2]) : 1000000);
+	}
+
 	// Are we in debugging mode?
 	bool DEBUG_MODE = true;
+
+	// Streaming mode (--stream): the model is preprocessed into a chunk file and chunks are loaded by camera distance
+	bool STREAM_MODE = false;
+	size_t gpuBudgetMB = 256;
+	size_t hostBudgetMB = 64;
+
+	// Load-time scratch memory comes from an arena unless --no-arena is given (for comparison)
+	bool USE_LOAD_ARENA = true;
+
+	// Hot reload (--watch): shaders, textures and the model are reloaded when their files change
+	bool HOT_RELOAD = false;
+
+	// Event-driven mode (--on-demand): only draw when the image would change, and wait for events in between
+	bool ON_DEMAND = false;
+
+	// Shadows from the point light (--no-shadows turns them off, for comparison)
+	bool SHADOWS = true;
+
+	// Recordings are written as numbered PNGs, or as one raw RGBA file with --record-raw
+	bool RECORD_RAW = false;
+
+	// Software mode (--software out.png): render on the CPU without a window or OpenGL context
+	bool SOFTWARE_MODE = false;
+	string softwareOutput;
+	int softwareFrames = 10;
+
+	// With --compare ref.png, the software frame is checked against a reference image (limits are in 8-bit steps)
+	string compareFilename;
+	double compareMax = 16.0;
+	double compareRMS = 1.0;
+
+	// BVH test mode (--bvh-test 10000): check BVH queries against brute force, without a window
+	int bvhTestQueries = 0;
+
+	for(int i = 2; i < argc; i++) {
+		string arg = argv[i];
+		if(arg == "--stream") STREAM_MODE = true;
+		else if(arg == "--no-arena") USE_LOAD_ARENA = false;
+		else if(arg == "--watch") HOT_RELOAD = true;
+		else if(arg == "--on-demand") ON_DEMAND = true;
+		else if(arg == "--no-shadows") SHADOWS = false;
+		else if(arg == "--record-raw") RECORD_RAW = true;
+		else if(arg == "--software" && i + 1 < argc) {
+			SOFTWARE_MODE = true;
+			softwareOutput = argv[++i];
+		}
+		else if(arg == "--software-frames" && i + 1 < argc) softwareFrames = max(1, stoi(argv[++i]));
+		else if(arg == "--compare" && i + 1 < argc) compareFilename = argv[++i];
+		else if(arg == "--compare-max" && i + 1 < argc) compareMax = stod(argv[++i]);
+		else if(arg == "--compare-rms" && i + 1 < argc) compareRMS = stod(argv[++i]);
+		else if(arg == "--bvh-test" && i + 1 < argc) bvhTestQueries = max(1, stoi(argv[++i]));
+		else if(arg == "--gpu-budget" && i + 1 < argc) gpuBudgetMB = stoul(argv[++i]);
+		else if(arg == "--host-budget" && i + 1 < argc) hostBudgetMB = stoul(argv[++i]);
+	}
+	string chunkFilename = string(argv[1]) + ".chunks";
 	
-	// Get aiscene with assimp
+	// Get aiscene with assimp (in streaming mode, only if the chunk file doesn't exist yet or the model changed)
 	Assimp::Importer importer;
-	const aiScene* scene = importer.ReadFile(argv[1], aiProcess_Triangulate | aiProcess_GenNormals | aiProcess_JoinIdenticalVertices | aiProcess_CalcTangentSpace);
+	const aiScene* scene = nullptr;
+	if(!STREAM_MODE || SOFTWARE_MODE || bvhTestQueries > 0 || !chunkFileIsCurrent(chunkFilename, argv[1])) {
+		scene = importer.ReadFile(argv[1], aiProcess_Triangulate | aiProcess_GenNormals | aiProcess_JoinIdenticalVertices | aiProcess_CalcTangentSpace);
 	
-	// Check if import was successful
-	if( (!scene) || (scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE) || !(scene->mRootNode) ) {
-		cout << "import was unsuccessful" << endl;
-		return false;
+		// Check if import was successful
+		if( (!scene) || (scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE) || !(scene->mRootNode) ) {
+			cout << "import was unsuccessful" << endl;
+			return false;
+		}
+	}
+
+	//Setup light
+	light.pos =  glm::vec4(0.5, 0.5, 0.5, 1.0);
+	light.color =  glm::vec4(1.0, 1.0, 1.0, 1.0);
+
+	// Render on the CPU instead (no window needed)
+	if(SOFTWARE_MODE) {
+		return runSoftwareRenderer(scene, softwareOutput, 800, 800, softwareFrames, compareFilename, compareMax, compareRMS);
+	}
+	if(bvhTestQueries > 0) {
+		return runBVHTest(scene, bvhTestQueries);
+	}
+
+	// Scratch arena for loading; released in one go once everything is uploaded
+	Arena loadScratch;
+	chrono::steady_clock::time_point loadStart = chrono::steady_clock::now();
+
+	// Preprocess into chunk file and read back its chunk table
+	SceneStreamer streamer;
+	if(STREAM_MODE) {
+		if(scene) {
+			cout << "Writing chunk file: " << chunkFilename << endl;
+			if(USE_LOAD_ARENA) loadArena = &loadScratch;
+			writeChunkFile(scene, chunkFilename, argv[1]);
+			loadArena = nullptr;
+			importer.FreeScene();
+			scene = nullptr;
+		}
+		streamer.open(chunkFilename);
 	}
 	
 	// Vector of MeshGLs
@@ -777,6 +1476,13 @@ int main(int argc, char **argv) {
 	//set the mouse callback function
 	glfwSetCursorPosCallback(window, mouse_position_callback);
 
+	//set the mouse button callback function
+	glfwSetMouseButtonCallback(window, mouse_button_callback);
+
+	//redraw after resizing or when the window contents are lost
+	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+	glfwSetWindowRefreshCallback(window, window_refresh_callback);
+
 	//hides the cursor
 	//glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
@@ -804,41 +1510,127 @@ int main(int argc, char **argv) {
 		programID = initShaderProgramFromSource(vertexCode, fragCode);
 	}
 	catch (exception e) {		
-		// Close program
-		cleanupGLFW(window);
-		exit(EXIT_FAILURE);
+		// With hot reload, keep going (drawing nothing) until the shaders are fixed
+		if(HOT_RELOAD) {
+			cout << "Waiting for shaders to be fixed..." << endl;
+		}
+		else {
+			// Close program
+			cleanupGLFW(window);
+			exit(EXIT_FAILURE);
+		}
 	}
 	
-	// Setup shape
-	for ( int i = 0; i < scene->mNumMeshes; i++ ) {
-		Mesh m;
-		MeshGL mgl;
-		extractMeshData(scene->mMeshes[i], m);
-		createMeshGL(m, mgl);
-		meshgls.push_back(mgl);
+	// Create shadow map shader (shadows are off while it doesn't build; with hot reload, until it does)
+	GLuint shadowProgramID = 0;
+	if(SHADOWS) {
+		try {
+			shadowProgramID = initShaderProgramFromSource(readFileToString("./Shadow.vs"), readFileToString("./Shadow.gs"), readFileToString("./Shadow.fs"));
+		}
+		catch (exception e) {
+			cout << "WARNING: Could not create shadow map shader; shadows are off" << endl;
+		}
 	}
+	
+	// Flatten node hierarchy
+	vector<SceneNode> sceneNodes;
+	SceneBVH sceneBVH;
+	vector<size_t> meshHashes;
+	unsigned int hwThreads = thread::hardware_concurrency();
+	if(STREAM_MODE) {
+		// Meshes get uploaded as their chunks stream in
+		sceneNodes = streamer.nodes;
+		meshgls.resize(streamer.chunks.size());
+		streamer.start(hwThreads > 2 ? 2 : 1, gpuBudgetMB*1024*1024, hostBudgetMB*1024*1024);
+	}
+	else {
+		// Setup shape (each mesh is extracted into the scratch arena, uploaded, then dropped)
+		if(USE_LOAD_ARENA) loadArena = &loadScratch;
+		for ( int i = 0; i < scene->mNumMeshes; i++ ) {
+			ArenaMarker marker = loadScratch.mark();
+			{
+				Mesh m;
+				MeshGL mgl;
+				extractMeshData(scene->mMeshes[i], m);
+				createMeshGL(m, mgl);
+				meshgls.push_back(mgl);
+				sceneBVH.addMesh(i, m);
+				if(HOT_RELOAD) meshHashes.push_back(hashMesh(m));
+			}
+			loadScratch.rewind(marker);
+		}
+		loadArena = nullptr;
+		flattenScene(scene->mRootNode, glm::mat4(1.0), sceneNodes);
 
-	// Get the matrix locations
-	GLint modelMatLoc = glGetUniformLocation(programID, "modelMat");
-	GLint viewMatLoc = glGetUniformLocation(programID, "viewMat");
-    GLint projMatLoc = glGetUniformLocation(programID, "projMat");
-	GLint normMatLoc = glGetUniformLocation(programID, "normMat");
-
-	//Setup light
-	light.pos =  glm::vec4(0.5, 0.5, 0.5, 1.0);
-	light.color =  glm::vec4(1.0, 1.0, 1.0, 1.0);
-	GLint lightPosLoc = glGetUniformLocation(programID, "light.pos");
-    GLint lightColorLoc = glGetUniformLocation(programID, "light.color");
+		// Everything we need is on the GPU or in sceneNodes now
+		importer.FreeScene();
+		scene = nullptr;
+	}
 
-	//setup roughness and metallic
-	GLint roughnessLoc = glGetUniformLocation(programID, "roughness");
-	GLint metallicLoc = glGetUniformLocation(programID, "metallic");
+	// Start worker threads for per-frame updates
+	WorkerPool workerPool(hwThreads > 1 ? hwThreads - 1 : 0);
+
+	// Build BVH for picking (not available in streaming mode, where meshes come and go)
+	vector<glm::mat4> nodeTransforms(sceneNodes.size());
+	float bvhAngle = rotAngle;
+	bool bvhStale = false;
+	if(!STREAM_MODE) {
+		for(int i = 0; i < sceneNodes.size(); i++) nodeTransforms[i] = nodeWorldMatrix(sceneNodes[i]);
+		chrono::steady_clock::time_point bvhStart = chrono::steady_clock::now();
+		sceneBVH.build(sceneNodes, nodeTransforms, workerPool);
+		double bvhMS = chrono::duration<double, milli>(chrono::steady_clock::now() - bvhStart).count();
+		cout << "BVH: " << sceneBVH.triangleCount() << " triangles, " << sceneBVH.nodeCount() << " nodes, built in " << bvhMS << " ms" << endl;
+	}
 
-	//setup texcoords and tangent
-	GLint diffuseTextureLoc = glGetUniformLocation(programID, "diffuseTexture");
-	GLint normalTextureLoc = glGetUniformLocation(programID, "normalTexture");
-	unsigned int diffuseID = loadAndCreateTexture("4977210.jpg");
-	unsigned int normalID = loadAndCreateTexture("./sampleModels/NormalMap.png");
+	// Create uniform ring buffer (one FrameUniforms plus one DrawUniforms per node, per frame)
+	UniformRing uniformRing;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &(uniformRing.alignment));
+	GLsizeiptr drawStride = alignUniformSize(uniformRing, sizeof(DrawUniforms));
+	createUniformRing(uniformRing, alignUniformSize(uniformRing, sizeof(FrameUniforms)) + drawStride*sceneNodes.size());
+
+	// Rebuilt every frame that is drawn
+	DrawList drawList;
+
+	// Create shadow map (its uniforms say "no shadows" until it is first rendered);
+	// the depth cube is only allocated if there is a shadow program to render it with
+	ShadowMap shadowMap;
+	createShadowMap(shadowMap, SHADOWS && shadowProgramID != 0);
+
+	// Create frame capture (readback buffers and PNG/raw encoder threads)
+	FrameCapture capture;
+	capture.create(hwThreads > 2 ? 2 : 1);
+	int screenshotCnt = 0;
+	int captureCnt = 0;
+
+	//setup texcoords and tangent (samplers are bound to units 0 and 1 in Basic.fs)
+	string diffusePath = "4977210.jpg";
+	string normalPath = "./sampleModels/NormalMap.png";
+	if(USE_LOAD_ARENA) loadArena = &loadScratch;
+	unsigned int diffuseID = loadAndCreateTexture(diffusePath);
+	loadScratch.rewind(ArenaMarker());
+	unsigned int normalID = loadAndCreateTexture(normalPath);
+	loadArena = nullptr;
+
+	// Loading is done; drop all scratch memory at once
+	double loadMS = chrono::duration<double, milli>(chrono::steady_clock::now() - loadStart).count();
+	cout << "Load time: " << loadMS << " ms" << endl;
+	cout << "Heap allocations (meshes, textures and arena blocks): " << heapAllocCnt.load() << endl;
+	cout << "Arena allocations: " << loadScratch.allocationCnt << " (peak " << loadScratch.peakBytes << " bytes)" << endl;
+	loadScratch.release();
+
+	// Report what the scene costs once loading is done
+	if(DEBUG_MODE) printMemoryStats();
+
+	// Watch shaders, textures and (unless streaming) the model for changes
+	AssetReloader reloader;
+	if(HOT_RELOAD) {
+		reloader.watchShaders("./Basic.vs", "./Basic.fs");
+		if(SHADOWS) reloader.watchShadowShaders("./Shadow.vs", "./Shadow.gs", "./Shadow.fs");
+		reloader.watchTexture(diffusePath);
+		reloader.watchTexture(normalPath);
+		if(!STREAM_MODE) reloader.watchModel(argv[1]);
+		reloader.start();
+	}
 
 	/*
 	// Create simple quad
@@ -854,17 +1646,87 @@ int main(int argc, char **argv) {
 	glEnable(GL_DEPTH_TEST);
 
 	while (!glfwWindowShouldClose(window)) {
-		// Set viewport size
-		int fwidth, fheight;
-		glfwGetFramebufferSize(window, &fwidth, &fheight);
-		glViewport(0, 0, fwidth, fheight);
+		// Swap in whatever the reloader has finished loading
+		if(HOT_RELOAD) {
+			vector<ReloadResult> reloads;
+			reloader.takeCompleted(reloads);
+			for(ReloadResult &result : reloads) {
+				if(result.kind == RELOAD_SHADER) {
+					// Only replace the program once the new one compiles and links
+					try {
+						GLuint newProgramID = initShaderProgramFromSource(result.vertexCode, result.fragCode);
+						glDeleteProgram(programID);
+						programID = newProgramID;
+						sceneDirty = true;
+					}
+					catch (exception e) {
+						cout << "Shader reload failed; keeping previous program" << endl;
+					}
+				}
+				else if(result.kind == RELOAD_SHADOW_SHADER) {
+					// Only swap programs once everything the new one needs exists
+					GLuint newProgramID = 0;
+					try {
+						newProgramID = initShaderProgramFromSource(result.vertexCode, result.geomCode, result.fragCode);
+						// The depth cube is skipped at startup if the shadow shaders didn't build then
+						if(shadowMap.depthCube == 0) createShadowDepth(shadowMap);
+						glDeleteProgram(shadowProgramID);
+						shadowProgramID = newProgramID;
+						shadowMap.valid = false;
+						sceneDirty = true;
+					}
+					catch (exception e) {
+						if(newProgramID) glDeleteProgram(newProgramID);
+						cout << "Shadow shader reload failed; keeping previous program" << endl;
+					}
+				}
+				else if(result.kind == RELOAD_TEXTURE) {
+					unsigned int &textureID = (result.path == diffusePath) ? diffuseID : normalID;
+					unsigned int newTextureID = createTextureFromImage(result.image);
+					cleanupTexture(textureID);
+					textureID = newTextureID;
+					sceneDirty = true;
+					cout << "Reloaded texture: " << result.path << endl;
+				}
+				else {
+					int uploaded = applyModelReload(result, meshgls, meshHashes, sceneNodes, sceneBVH);
+					nodeTransforms.resize(sceneNodes.size());
+					bvhStale = true;
+					sceneDirty = true;
+					shadowMap.valid = false;
+
+					// Grow the uniform ring if there are more nodes now
+					GLsizeiptr needed = alignUniformSize(uniformRing, sizeof(FrameUniforms)) + drawStride*sceneNodes.size();
+					if(alignUniformSize(uniformRing, needed) > uniformRing.regionSize) {
+						cleanupUniformRing(uniformRing);
+						createUniformRing(uniformRing, needed);
+					}
+					cout << "Reloaded model: " << result.path << " (" << uploaded << " of " << meshgls.size() << " meshes uploaded)" << endl;
+				}
+			}
+		}
 
-		// Clear the framebuffer
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		// Stream chunks in and out around the camera (only a change in what is resident needs a redraw)
+		if(STREAM_MODE) {
+			unsigned long streamChanges = streamer.stats.loads + streamer.stats.evictions;
+			streamer.update(meshgls, eye);
+			if(streamer.stats.loads + streamer.stats.evictions != streamChanges) {
+				sceneDirty = true;
+				shadowMap.valid = false;
+			}
+		}
 
-		// Use shader program
-		glUseProgram(programID);
+		// Print memory (and streaming) statistics on request
+		if(showStats) {
+			printMemoryStats();
+			if(STREAM_MODE) printStreamStats(streamer.stats, (int)streamer.chunks.size());
+			if(SHADOWS && shadowProgramID) cout << "Shadow map renders: " << shadowMap.renders << endl;
+			cout << "Draw list: " << drawList.items.size() << " meshes drawn, " << drawList.culledCnt << " outside the view, ";
+			cout << drawList.tooSmallCnt << " too small" << endl;
+			showStats = false;
+		}
 
+		int fwidth, fheight;
 		glfwGetFramebufferSize(window, &fwidth, &fheight);
 		double aspectRatio;
 		if(fwidth == 0 || fheight == 0){
@@ -876,54 +1738,167 @@ int main(int argc, char **argv) {
 
 		//Calculation of View Matrix
 		glm::mat4 viewMat = glm::lookAt(eye, lookAt, glm::vec3(0,1,0));
-		glUniformMatrix4fv(viewMatLoc, 1, false, glm::value_ptr(viewMat));
 
 		//Calculation of Projection Matrix
 		glm::mat4 projMat = glm::perspective(glm::radians(90.0), aspectRatio, 0.01, 50.0);
-		glUniformMatrix4fv(projMatLoc, 1, false, glm::value_ptr(projMat));
-
-		// Calculation of light
-		glm::vec4 lightPos = viewMat * light.pos;
-		glUniform4fv(lightPosLoc, 1, glm::value_ptr(light.pos));
-		glUniform4fv(lightColorLoc, 1, glm::value_ptr(light.color));
-
-		// Calculation using Roughness and metallic
-		glUniform1f(roughnessLoc, roughness);
-		glUniform1f(metallicLoc, metallic);
-
-		// Calculation of Diffuse Texture and Tangents
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, diffuseID);
-		glUniform1i(diffuseTextureLoc, 0);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, normalID);
-		glUniform1i(normalTextureLoc, 1);
+
+		// Pick whatever is under the cursor (refitting the BVH first if J/K rotated the nodes)
+		if(pickRequested) {
+			pickRequested = false;
+			if(bvhStale || rotAngle != bvhAngle) {
+				for(int i = 0; i < sceneNodes.size(); i++) nodeTransforms[i] = nodeWorldMatrix(sceneNodes[i]);
+				sceneBVH.refit(nodeTransforms, workerPool);
+				bvhAngle = rotAngle;
+				bvhStale = false;
+			}
+
+			int wwidth, wheight;
+			glfwGetWindowSize(window, &wwidth, &wheight);
+			if(wwidth > 0 && wheight > 0) {
+				glm::vec2 ndc(2.0f*pickPos.x/wwidth - 1.0f, 1.0f - 2.0f*pickPos.y/wheight);
+				glm::mat4 invViewProj = glm::inverse(projMat * viewMat);
+				glm::vec4 nearPoint = invViewProj * glm::vec4(ndc.x, ndc.y, -1.0, 1.0);
+				glm::vec4 farPoint = invViewProj * glm::vec4(ndc.x, ndc.y, 1.0, 1.0);
+				glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+				glm::vec3 dir = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+
+				RayHit hit;
+				if(sceneBVH.rayCast(origin, dir, hit)) {
+					cout << "Selected node " << hit.node << ", mesh " << hit.mesh << ", triangle " << hit.triangle;
+					cout << " at distance " << hit.t << endl;
+				}
+				else {
+					cout << "Nothing selected" << endl;
+				}
+			}
+		}
+
+		// Start/stop recording and queue screenshots (both are read back from the next frame drawn)
+		if(recordToggleRequested) {
+			recordToggleRequested = false;
+			if(capture.isRecording()) capture.stopRecording();
+			else capture.startRecording("capture_" + to_string(captureCnt++), RECORD_RAW);
+		}
+		if(screenshotRequested) {
+			screenshotRequested = false;
+			capture.requestScreenshot("screenshot_" + to_string(screenshotCnt++) + ".png");
+		}
+
+		// Draw every iteration, or with --on-demand only when something changed since the last frame
+		// (or every frame while recording)
+		if(!ON_DEMAND || sceneDirty || capture.isRecording()) {
+			sceneDirty = false;
+
+			// Set viewport size
+			glViewport(0, 0, fwidth, fheight);
+
+			// Clear the framebuffer
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+			// Use shader program
+			glUseProgram(programID);
+
+			// Grab this frame's region of the uniform ring buffer
+			beginUniformFrame(uniformRing);
+			GLintptr frameOffset = allocUniforms(uniformRing, sizeof(FrameUniforms));
+			FrameUniforms *frameData = (FrameUniforms*)uniformPtr(uniformRing, frameOffset);
+			frameData->viewMat = viewMat;
+			frameData->projMat = projMat;
+
+			// Calculation of light
+			frameData->light = light;
+
+			// Calculation using Roughness and metallic
+			frameData->roughness = roughness;
+			frameData->metallic = metallic;
+
+			// Calculation of Diffuse Texture and Tangents
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, diffuseID);
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, normalID);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_CUBE_MAP, shadowMap.depthCube);
+			glBindBufferBase(GL_UNIFORM_BUFFER, 2, shadowMap.uniformBuffer);
 		
-		/*
-		// Draw objects
-		for (MeshGL mgl : meshgls) {
-			drawMesh(mgl);
+			/*
+			// Draw objects
+			for (MeshGL mgl : meshgls) {
+				drawMesh(mgl);
+			}
+			*/
+
+			// Write per-draw constants, then bind everything by offset and draw
+			GLintptr drawOffset = allocUniforms(uniformRing, drawStride*sceneNodes.size());
+			buildDrawList(sceneNodes, meshgls, viewMat, projMat, fheight, uniformPtr(uniformRing, drawOffset), drawStride, drawList, workerPool);
+			flushUniformFrame(uniformRing);
+
+			// Re-render the cached shadow map only if the light or a caster near it moved
+			// (the light is given in view space, so it moves with the camera)
+			if(SHADOWS && shadowProgramID) {
+				glm::vec3 lightWorldPos = glm::vec3(glm::inverse(viewMat) * light.pos);
+				if(shadowMapNeedsUpdate(shadowMap, lightWorldPos, sceneNodes, drawList.worldMats, meshgls)) {
+					renderShadowMap(shadowMap, shadowProgramID, lightWorldPos, meshgls, sceneNodes, drawList.worldMats, uniformRing.buffer, drawOffset, drawStride);
+					glViewport(0, 0, fwidth, fheight);
+					glUseProgram(programID);
+				}
+			}
+
+			glBindBufferRange(GL_UNIFORM_BUFFER, 0, uniformRing.buffer, frameOffset, sizeof(FrameUniforms));
+			if(programID) renderDrawList(meshgls, drawList, uniformRing.buffer, drawOffset, drawStride);
+			endUniformFrame(uniformRing);
+
+			// Start reading the frame back if it is being captured (finishes a few frames later)
+			capture.captureFrame(fwidth, fheight);
+
+			// Swap buffers
+			glfwSwapBuffers(window);
 		}
-		*/
 
-		renderScene(meshgls, scene->mRootNode, glm::mat4(1.0), modelMatLoc, normMatLoc, viewMat, 0);
+		// Hand finished readbacks to the encoder threads
+		capture.collect();
 
-		// Swap buffers and poll for window events		
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+		if(ON_DEMAND) {
+			// Block until there is input, a resize, or a background thread posts an empty event
+			// (keep going at the normal frame rate while recording or while readbacks are in flight)
+			if(capture.isRecording() || capture.busy()) glfwWaitEventsTimeout(0.015);
+			else glfwWaitEvents();
+		}
+		else {
+			// Poll for window events
+			glfwPollEvents();
 
-		// Sleep for 15 ms
-		this_thread::sleep_for(chrono::milliseconds(15));
+			// Sleep for 15 ms
+			this_thread::sleep_for(chrono::milliseconds(15));
+		}
 	}
 
+	// Stop loading chunks and watching files
+	streamer.stop();
+	reloader.stop();
+
 	// Clean up meshes
 	for (MeshGL mgl : meshgls) {
 		cleanupMesh(mgl);
 	}
 
+	// Clean up textures
+	cleanupTexture(diffuseID);
+	cleanupTexture(normalID);
+
+	// Clean up uniform ring buffer
+	cleanupUniformRing(uniformRing);
+
+	// Clean up shadow map
+	cleanupShadowMap(shadowMap);
+
+	// Finish writing captured frames
+	capture.cleanup();
+
 	// Clean up shader programs
 	glUseProgram(0);
 	glDeleteProgram(programID);
+	glDeleteProgram(shadowProgramID);
 		
 	// Destroy window and stop GLFW
 	cleanupGLFW(window);
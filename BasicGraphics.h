@@ -0,0 +1,484 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <array>
+#include <map>
+#include <memory>
+#include <filesystem>
+#include <GL/glew.h>					
+#include <GLFW/glfw3.h>
+#include "glm/glm.hpp"
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtx/transform.hpp"
+#define GLM_ENABLE_EXPERIMENTAL
+#include "glm/gtx/string_cast.hpp"
+#include "glm/gtc/type_ptr.hpp"
+#include <chrono>
+#include <random>
+
+using namespace std;
+
+// Categories of memory tracked by the memory accounting
+enum MemCategory { MEM_VERTEX, MEM_INDEX, MEM_TEXTURE, MEM_UNIFORM, MEM_STAGING, MEM_BVH, MEM_CATEGORY_CNT };
+
+// Where tracked memory lives
+enum MemLocation { MEM_HOST, MEM_GPU, MEM_LOCATION_CNT };
+
+// Struct for holding current and peak bytes of one category
+// (atomic, since loader and worker threads allocate too)
+struct MemCounter {
+	atomic<long long> current{0};
+	atomic<long long> peak{0};
+};
+
+extern MemCounter memCounters[MEM_LOCATION_CNT][MEM_CATEGORY_CNT];
+
+// Record an allocation of bytes
+void trackAlloc(MemLocation location, MemCategory category, long long bytes);
+
+// Record a free of bytes
+void trackFree(MemLocation location, MemCategory category, long long bytes);
+
+// Print out current and peak usage of every category
+void printMemoryStats();
+
+// Number of heap allocations made through TrackedAllocator, stb_image and Arena blocks (for load statistics)
+extern atomic<unsigned long> heapAllocCnt;
+
+// Position in an Arena that can be rewound to
+struct ArenaMarker {
+	size_t block = 0;
+	size_t used = 0;
+};
+
+// Linear allocator for load-time scratch memory.
+// Allocating just bumps an offset; nothing is freed individually, and rewind()/release() drop everything at once.
+class Arena {
+public:
+	unsigned long allocationCnt = 0;
+	size_t peakBytes = 0;
+
+	Arena(size_t blockSize = 16*1024*1024) : blockSize(blockSize) {}
+
+	~Arena() {
+		release();
+	}
+
+	// Get bytes of memory (16-byte aligned)
+	void* allocate(size_t bytes) {
+		bytes = (bytes + 15) & ~(size_t)15;
+		// Move on to the next block (reusing one we already have if it's big enough)
+		while(blocks.empty() || blocks[current].used + bytes > blocks[current].size) {
+			if(!blocks.empty() && current + 1 < blocks.size()) {
+				current++;
+				blocks[current].used = 0;
+				if(bytes <= blocks[current].size) break;
+			}
+			else {
+				Block b;
+				b.size = max(blockSize, bytes);
+				b.data = (unsigned char*)malloc(b.size);
+				if(!b.data) throw bad_alloc();
+				heapAllocCnt++;
+				trackAlloc(MEM_HOST, MEM_STAGING, b.size);
+				blocks.push_back(b);
+				current = blocks.size() - 1;
+				break;
+			}
+		}
+
+		Block &b = blocks[current];
+		void *p = b.data + b.used;
+		b.used += bytes;
+		allocationCnt++;
+		peakBytes = max(peakBytes, usedBytes());
+		return p;
+	}
+
+	// Does p point into memory handed out by this arena?
+	bool owns(const void *p) {
+		for(Block &b : blocks) {
+			if(p >= b.data && p < b.data + b.size) return true;
+		}
+		return false;
+	}
+
+	ArenaMarker mark() {
+		ArenaMarker marker;
+		marker.block = current;
+		marker.used = blocks.empty() ? 0 : blocks[current].used;
+		return marker;
+	}
+
+	// Drop everything allocated since marker (blocks are kept for reuse)
+	void rewind(ArenaMarker marker) {
+		if(blocks.empty()) return;
+		current = marker.block;
+		blocks[current].used = marker.used;
+	}
+
+	// Free all blocks
+	void release() {
+		for(Block &b : blocks) {
+			trackFree(MEM_HOST, MEM_STAGING, b.size);
+			free(b.data);
+		}
+		blocks.clear();
+		current = 0;
+	}
+
+private:
+	struct Block {
+		unsigned char *data = nullptr;
+		size_t size = 0;
+		size_t used = 0;
+	};
+
+	size_t usedBytes() {
+		size_t total = 0;
+		for(size_t i = 0; i <= current && i < blocks.size(); i++) total += blocks[i].used;
+		return total;
+	}
+
+	size_t blockSize;
+	vector<Block> blocks;
+	size_t current = 0;
+};
+
+// Arena used for scratch allocations on this thread while loading (null = use the heap).
+// Anything allocated from it must be gone before the arena is rewound or released.
+extern thread_local Arena *loadArena;
+
+// STL allocator that reports host allocations to the memory accounting.
+// While a load arena is set, memory comes from the arena instead (already counted as staging).
+template<typename T, MemCategory CATEGORY>
+struct TrackedAllocator {
+	typedef T value_type;
+
+	template<typename U>
+	struct rebind { typedef TrackedAllocator<U, CATEGORY> other; };
+
+	TrackedAllocator() {}
+	template<typename U>
+	TrackedAllocator(const TrackedAllocator<U, CATEGORY> &) {}
+
+	T* allocate(size_t n) {
+		if(loadArena) return (T*)loadArena->allocate(n*sizeof(T));
+		heapAllocCnt++;
+		T *p = (T*)::operator new(n*sizeof(T));
+		trackAlloc(MEM_HOST, CATEGORY, n*sizeof(T));
+		return p;
+	}
+
+	void deallocate(T *p, size_t n) {
+		if(loadArena && loadArena->owns(p)) return;
+		trackFree(MEM_HOST, CATEGORY, n*sizeof(T));
+		::operator delete(p);
+	}
+};
+
+template<typename T, typename U, MemCategory CATEGORY>
+bool operator==(const TrackedAllocator<T, CATEGORY> &, const TrackedAllocator<U, CATEGORY> &) { return true; }
+template<typename T, typename U, MemCategory CATEGORY>
+bool operator!=(const TrackedAllocator<T, CATEGORY> &, const TrackedAllocator<U, CATEGORY> &) { return false; }
+
+// Struct for holding vertex data
+struct Vertex {
+	glm::vec3 position;
+	glm::vec4 color;
+	glm::vec3 normal;
+	glm::vec2 texcoords;
+	glm::vec3 tangent;
+};
+
+// Struct for holding mesh data
+struct Mesh {
+	vector<Vertex, TrackedAllocator<Vertex, MEM_VERTEX>> vertices;
+	vector<unsigned int, TrackedAllocator<unsigned int, MEM_INDEX>> indices;
+};
+
+// Struct for holding OpenGL mesh
+struct MeshGL {
+	GLuint VBO = 0;
+	GLuint EBO = 0;
+	GLuint VAO = 0;
+	int vertexCnt = 0;
+	int indexCnt = 0;
+	glm::vec3 boundsMin = glm::vec3(0);		// Object-space bounds
+	glm::vec3 boundsMax = glm::vec3(0);
+};
+
+// Struct for holding a scene node flattened out of the aiNode hierarchy
+struct SceneNode {
+	glm::mat4 modelMat;			// Accumulated parent * node transform
+	vector<int> meshIndices;
+};
+
+// Struct for holding PointLight mesh
+struct PointLight {
+	glm::vec4 pos;
+	glm::vec4 color;
+};
+
+// Per-frame constants (std140 layout of FrameData in Basic.vs/Basic.fs)
+struct FrameUniforms {
+	glm::mat4 viewMat;
+	glm::mat4 projMat;
+	PointLight light;
+	float metallic;
+	float roughness;
+	float padding[2];
+};
+
+// Per-draw constants (std140 layout of DrawData in Basic.vs/Basic.fs)
+struct DrawUniforms {
+	glm::mat4 modelMat;
+	glm::mat4 normMat;
+};
+
+// One visible mesh of a scene node
+struct DrawItem {
+	unsigned long long sortKey;		// View depth of the mesh's bounds (front to back), then its position in the scene
+	int node;
+	int mesh;
+};
+
+// Everything the OpenGL thread needs to replay a frame
+struct DrawList {
+	vector<glm::mat4> worldMats;	// Every node's world matrix (also what the shadow map is checked against)
+	vector<DrawItem> items;			// Visible meshes, sorted by sortKey
+	int culledCnt = 0;				// Outside the view frustum
+	int tooSmallCnt = 0;			// Under MIN_DRAW_PIXELS across on screen
+};
+
+// Decoded texture waiting to be uploaded (pixels are owned by stb_image and counted as staging memory)
+struct TextureImage {
+    unsigned char *pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    long long trackedBytes = 0;     // Counted as staging (0 if the pixels live in a load arena, which is counted already)
+
+    TextureImage() {}
+    TextureImage(const TextureImage &) = delete;
+    TextureImage& operator=(const TextureImage &) = delete;
+    TextureImage(TextureImage &&other) {
+        *this = move(other);
+    }
+    TextureImage& operator=(TextureImage &&other) {
+        if(this != &other) {
+            release();
+            pixels = other.pixels;
+            width = other.width;
+            height = other.height;
+            channels = other.channels;
+            trackedBytes = other.trackedBytes;
+            other.pixels = nullptr;
+            other.trackedBytes = 0;
+        }
+        return *this;
+    }
+    ~TextureImage() {
+        release();
+    }
+
+    // Free the pixels (and their staging count)
+    void release();
+};
+
+// Pool of worker threads used to split per-frame CPU work across cores
+class WorkerPool {
+public:
+	WorkerPool(unsigned int threadCnt) : ranges(new WorkRange[threadCnt + 1]) {
+		for(unsigned int i = 0; i < threadCnt; i++) {
+			workers.push_back(thread(&WorkerPool::workerLoop, this, (int)i + 1));
+		}
+	}
+
+	~WorkerPool() {
+		{
+			lock_guard<mutex> guard(poolMutex);
+			quitting = true;
+		}
+		wakeCV.notify_all();
+		for(thread &t : workers) {
+			t.join();
+		}
+	}
+
+	// Number of worker threads (not counting the thread calling parallelFor)
+	int threadCount() {
+		return (int)workers.size();
+	}
+
+	// Calls func(i) for every i in [0, count) and returns once all calls are finished.
+	// Every thread (the calling thread included) starts on an equal share of the indices and runs it in chunks;
+	// a thread that runs out steals half of what another thread has left.
+	void parallelFor(int count, const function<void(int)> &func) {
+		if(workers.empty() || count <= 1) {
+			for(int i = 0; i < count; i++) {
+				func(i);
+			}
+			return;
+		}
+
+		{
+			lock_guard<mutex> guard(poolMutex);
+			int participants = (int)workers.size() + 1;
+			for(int p = 0; p < participants; p++) {
+				ranges[p].bounds = packRange((long long)count*p / participants, (long long)count*(p + 1) / participants);
+			}
+			// Small chunks when there are few indices (each may be a lot of work), up to CHUNK_SIZE otherwise
+			chunkSize = max(1, min(CHUNK_SIZE, count / (participants*8)));
+			job = &func;
+			busyCnt = (int)workers.size();
+			generation++;
+		}
+		wakeCV.notify_all();
+
+		runChunks(0);
+
+		unique_lock<mutex> lock(poolMutex);
+		doneCV.wait(lock, [this] { return busyCnt == 0; });
+		job = nullptr;
+	}
+
+private:
+	static constexpr int CHUNK_SIZE = 16;
+
+	// Indices [begin, end) a thread has left, packed into one word so that its owner (taking chunks from the front)
+	// and thieves (taking half from the back) can both claim indices with a compare-exchange
+	struct alignas(64) WorkRange {
+		atomic<unsigned long long> bounds{0};
+	};
+
+	static unsigned long long packRange(unsigned int begin, unsigned int end) {
+		return ((unsigned long long)begin << 32) | end;
+	}
+
+	// Run the next chunk of our own range; returns false once it is empty
+	bool runOwnChunk(int self) {
+		WorkRange &own = ranges[self];
+		unsigned long long old = own.bounds.load();
+		while(true) {
+			unsigned int begin = (unsigned int)(old >> 32), end = (unsigned int)old;
+			if(begin >= end) return false;
+			unsigned int chunkEnd = min(begin + (unsigned int)chunkSize, end);
+			if(own.bounds.compare_exchange_weak(old, packRange(chunkEnd, end))) {
+				for(unsigned int i = begin; i < chunkEnd; i++) {
+					(*job)((int)i);
+				}
+				return true;
+			}
+		}
+	}
+
+	// Move the back half of another thread's range into our own (empty) one; returns false if nothing is left anywhere
+	bool steal(int self) {
+		int participants = (int)workers.size() + 1;
+		for(int k = 1; k < participants; k++) {
+			WorkRange &victim = ranges[(self + k) % participants];
+			unsigned long long old = victim.bounds.load();
+			while(true) {
+				unsigned int begin = (unsigned int)(old >> 32), end = (unsigned int)old;
+				if(begin >= end) break;
+				unsigned int middle = end - (end - begin + 1) / 2;
+				if(victim.bounds.compare_exchange_weak(old, packRange(begin, middle))) {
+					ranges[self].bounds = packRange(middle, end);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	void runChunks(int self) {
+		while(runOwnChunk(self) || steal(self)) {}
+	}
+
+	void workerLoop(int self) {
+		unsigned long seenGeneration = 0;
+		while(true) {
+			{
+				unique_lock<mutex> lock(poolMutex);
+				wakeCV.wait(lock, [&] { return quitting || generation != seenGeneration; });
+				if(quitting) return;
+				seenGeneration = generation;
+			}
+
+			runChunks(self);
+
+			lock_guard<mutex> guard(poolMutex);
+			busyCnt--;
+			if(busyCnt == 0) doneCV.notify_one();
+		}
+	}
+
+	vector<thread> workers;
+	unique_ptr<WorkRange[]> ranges;		// One per thread; the calling thread is 0
+	mutex poolMutex;
+	condition_variable wakeCV;
+	condition_variable doneCV;
+	const function<void(int)> *job = nullptr;
+	int chunkSize = CHUNK_SIZE;
+	int busyCnt = 0;
+	unsigned long generation = 0;
+	bool quitting = false;
+};
+
+// Global state shared with the subsystems (defined in BasicGraphics.cpp)
+extern float rotAngle;
+extern PointLight light;
+extern glm::vec3 eye;
+extern glm::vec3 lookAt;
+extern float metallic;
+extern float roughness;
+
+// Read from file and dump in string
+string readFileToString(string filename);
+
+// Extract vertex and index data of an imported mesh
+void extractMeshData(aiMesh *mesh, Mesh &m);
+
+// Create OpenGL mesh (VAO) from mesh data
+void createMeshGL(Mesh &m, MeshGL &mgl);
+
+// Cleanup OpenGL mesh
+void cleanupMesh(MeshGL &mgl);
+
+// Decode a texture file into CPU memory; safe to call from any thread.
+// Returns false (after printing why) if the file can't be used as a texture.
+bool decodeTexture(string filename, TextureImage &image);
+
+// Walk the aiNode hierarchy once and store the accumulated transform of every node that has meshes
+void flattenScene(aiNode *node, glm::mat4 parentMat, vector<SceneNode> &nodes);
+
+// World matrix of a scene node this frame (its load-time transform plus the J/K rotation)
+glm::mat4 nodeWorldMatrix(SceneNode &node);
+
+// Write the model and normal matrices of a node with world matrix worldMat
+void writeDrawUniforms(glm::mat4 worldMat, glm::mat4 viewMat, DrawUniforms *draw);
+
+// Meshes smaller than this on screen (bounding sphere diameter, in pixels) are not drawn
+const float MIN_DRAW_PIXELS = 1.0f;
+
+// Build the frame's draw list in parallel: transform every node (writing node i's constants to drawData + i*stride,
+// which points straight into the uniform ring buffer), cull meshes against the view frustum, drop meshes too small
+// to see, and sort the rest front to back. Meshes that aren't resident (VAO 0, streaming mode) are skipped.
+void buildDrawList(vector<SceneNode> &nodes, vector<MeshGL> &allMeshes, glm::mat4 viewMat, glm::mat4 projMat, int viewportHeight,
+					unsigned char *drawData, GLsizeiptr stride, DrawList &list, WorkerPool &pool);
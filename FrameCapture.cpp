@@ -0,0 +1,250 @@
+#include "FrameCapture.h"
+#include "stb_image_write.h"
+
+void FrameCapture::create(int encoderCnt) {
+	for(Readback &rb : ring) {
+		glGenBuffers(1, &(rb.pbo));
+	}
+	quitting = false;
+	for(int i = 0; i < encoderCnt; i++) {
+		encoders.push_back(thread(&FrameCapture::encoderLoop, this));
+	}
+}
+
+void FrameCapture::startRecording(string prefix, bool raw) {
+	recordPrefix = prefix;
+	recordFrame = 0;
+	droppedFrames = 0;
+	if(raw) {
+		rawStream = make_shared<RawStream>();
+		rawStream->file.open(prefix + ".rgba", ios::binary);
+		if(!rawStream->file) {
+			cout << "ERROR: Could not open " << prefix << ".rgba for recording" << endl;
+			rawStream = nullptr;
+			return;
+		}
+	}
+	recording = true;
+	cout << "Recording to " << prefix << (raw ? ".rgba" : "_*.png") << endl;
+}
+
+void FrameCapture::stopRecording() {
+	if(!recording) return;
+	recording = false;
+	cout << "Recorded " << recordFrame << " frames (" << droppedFrames << " dropped)" << endl;
+	if(rawStream) {
+		cout << "Convert with: ffmpeg -f rawvideo -pix_fmt rgba -s " << recordWidth << "x" << recordHeight;
+		cout << " -i " << recordPrefix << ".rgba " << recordPrefix << ".mp4" << endl;
+	}
+	// Queued frames keep the raw stream open until they are written
+	rawStream = nullptr;
+}
+
+bool FrameCapture::busy() {
+	for(Readback &rb : ring) {
+		if(rb.fence) return true;
+	}
+	return false;
+}
+
+void FrameCapture::captureFrame(int width, int height) {
+	if(screenshotFile.empty() && !recording) return;
+	if(width <= 0 || height <= 0) return;
+
+	// The oldest slot may still be in flight; a screenshot waits for it, a recording drops this frame
+	Readback &rb = ring[next];
+	if(rb.fence) collectSlot(rb, !screenshotFile.empty());
+	bool backlogged = queuedFrames() >= MAX_QUEUED_FRAMES;
+	bool record = recording && !rb.fence && !backlogged;
+	if(recording && !record) droppedFrames++;
+	if(!record && screenshotFile.empty()) return;
+
+	// A raw stream has a fixed frame size
+	if(record && rawStream) {
+		if(recordFrame == 0) {
+			recordWidth = width;
+			recordHeight = height;
+		}
+		else if(width != recordWidth || height != recordHeight) {
+			cout << "Window size changed; stopping raw recording" << endl;
+			stopRecording();
+			record = false;
+			if(screenshotFile.empty()) return;
+		}
+	}
+
+	GLsizeiptr size = (GLsizeiptr)width*height*4;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+	if(size > rb.capacity) {
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+		trackAlloc(MEM_GPU, MEM_STAGING, size - rb.capacity);
+		rb.capacity = size;
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	rb.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	rb.width = width;
+	rb.height = height;
+	rb.screenshotFile.swap(screenshotFile);
+	screenshotFile.clear();
+	rb.recordFile.clear();
+	rb.rawStream = nullptr;
+	rb.rawFrame = -1;
+	if(record) {
+		if(rawStream) {
+			rb.rawStream = rawStream;
+			rb.rawFrame = recordFrame;
+		}
+		else {
+			char frameName[16];
+			snprintf(frameName, sizeof(frameName), "_%05ld.png", recordFrame);
+			rb.recordFile = recordPrefix + frameName;
+		}
+		recordFrame++;
+	}
+	next = (next + 1) % CAPTURE_RING_SIZE;
+}
+
+void FrameCapture::collect() {
+	// Oldest first, stopping at the first unfinished readback: jobs must be queued in frame order, or an encoder
+	// could take a raw frame and wait forever for one that is still in the ring
+	for(int i = 0; i < CAPTURE_RING_SIZE; i++) {
+		Readback &rb = ring[(next + i) % CAPTURE_RING_SIZE];
+		if(!rb.fence) continue;
+		collectSlot(rb, false);
+		if(rb.fence) return;
+	}
+}
+
+void FrameCapture::cleanup() {
+	stopRecording();
+	for(int i = 0; i < CAPTURE_RING_SIZE; i++) {
+		Readback &rb = ring[(next + i) % CAPTURE_RING_SIZE];
+		if(rb.fence) collectSlot(rb, true);
+	}
+	stopEncoders();
+	for(Readback &rb : ring) {
+		glDeleteBuffers(1, &(rb.pbo));
+		rb.pbo = 0;
+		trackFree(MEM_GPU, MEM_STAGING, rb.capacity);
+		rb.capacity = 0;
+	}
+	for(vector<unsigned char> &buffer : spareBuffers) {
+		trackFree(MEM_HOST, MEM_STAGING, buffer.capacity());
+	}
+	spareBuffers.clear();
+}
+
+void FrameCapture::collectSlot(Readback &rb, bool wait) {
+	GLenum result = glClientWaitSync(rb.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	while(wait && result == GL_TIMEOUT_EXPIRED) {
+		result = glClientWaitSync(rb.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+	}
+	if(result == GL_TIMEOUT_EXPIRED) return;
+	glDeleteSync(rb.fence);
+	rb.fence = nullptr;
+
+	EncodeJob job;
+	job.width = rb.width;
+	job.height = rb.height;
+	job.screenshotFile.swap(rb.screenshotFile);
+	job.recordFile.swap(rb.recordFile);
+	job.rawStream = move(rb.rawStream);
+	job.rawFrame = rb.rawFrame;
+
+	size_t rowBytes = (size_t)rb.width*4;
+	size_t size = rowBytes*rb.height;
+	{
+		lock_guard<mutex> guard(queueMutex);
+		if(!spareBuffers.empty()) {
+			job.pixels.swap(spareBuffers.back());
+			spareBuffers.pop_back();
+		}
+	}
+	size_t oldCapacity = job.pixels.capacity();
+	job.pixels.resize(size);
+	trackAlloc(MEM_HOST, MEM_STAGING, job.pixels.capacity() - oldCapacity);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+	unsigned char *mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if(mapped) {
+		for(int y = 0; y < rb.height; y++) {
+			memcpy(&job.pixels[y*rowBytes], mapped + (rb.height - 1 - y)*rowBytes, rowBytes);
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if(!mapped) {
+		// Raw frames are written in order, so a lost one is still queued (as black)
+		cout << "ERROR: Could not map capture buffer" << endl;
+		memset(job.pixels.data(), 0, size);
+		job.screenshotFile.clear();
+		job.recordFile.clear();
+	}
+
+	{
+		lock_guard<mutex> guard(queueMutex);
+		jobs.push_back(move(job));
+	}
+	jobCV.notify_one();
+}
+
+void FrameCapture::encoderLoop() {
+	while(true) {
+		EncodeJob job;
+		{
+			unique_lock<mutex> lock(queueMutex);
+			jobCV.wait(lock, [this] { return quitting || !jobs.empty(); });
+			if(jobs.empty()) return;
+			job = move(jobs.front());
+			jobs.pop_front();
+		}
+
+		if(!job.screenshotFile.empty()) {
+			if(stbi_write_png(job.screenshotFile.c_str(), job.width, job.height, 4, job.pixels.data(), job.width*4)) {
+				cout << "Saved screenshot: " << job.screenshotFile << endl;
+			}
+			else {
+				cout << "ERROR: Could not write " << job.screenshotFile << endl;
+			}
+		}
+		if(!job.recordFile.empty()) {
+			if(!stbi_write_png(job.recordFile.c_str(), job.width, job.height, 4, job.pixels.data(), job.width*4)) {
+				cout << "ERROR: Could not write " << job.recordFile << endl;
+			}
+		}
+
+		// Raw frames may be encoded by several threads at once, but are appended strictly in order
+		if(job.rawStream) {
+			RawStream &stream = *job.rawStream;
+			unique_lock<mutex> lock(stream.streamMutex);
+			stream.turnCV.wait(lock, [&] { return stream.nextFrame == job.rawFrame; });
+			stream.file.write((const char*)job.pixels.data(), job.pixels.size());
+			stream.nextFrame++;
+			stream.turnCV.notify_all();
+		}
+
+		// Keep the buffer for the next frame
+		lock_guard<mutex> guard(queueMutex);
+		if(spareBuffers.size() < MAX_QUEUED_FRAMES) {
+			spareBuffers.push_back(move(job.pixels));
+		}
+		else {
+			trackFree(MEM_HOST, MEM_STAGING, job.pixels.capacity());
+		}
+	}
+}
+
+void FrameCapture::stopEncoders() {
+	{
+		lock_guard<mutex> guard(queueMutex);
+		quitting = true;
+	}
+	jobCV.notify_all();
+	for(thread &t : encoders) {
+		t.join();
+	}
+	encoders.clear();
+}
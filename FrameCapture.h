@@ -0,0 +1,111 @@
+#pragma once
+
+#include "BasicGraphics.h"
+
+// Number of pixel pack buffers frames are read back into
+const int CAPTURE_RING_SIZE = 3;
+
+// Raw recording: frames are appended to one file in capture order
+struct RawStream {
+	ofstream file;
+	mutex streamMutex;
+	condition_variable turnCV;
+	long nextFrame = 0;
+};
+
+// Asynchronous frame capture (screenshots and recording).
+// glReadPixels goes into a ring of pixel pack buffers, so it returns right away; a few frames later, once the
+// fence says the copy is done, the pixels are copied out and handed to encoder threads, which write PNGs or
+// append raw RGBA frames to a file. When the GPU or the encoders fall behind, recorded frames are dropped
+// rather than stalling the render loop.
+class FrameCapture {
+public:
+	static const int MAX_QUEUED_FRAMES = 8;
+
+	~FrameCapture() {
+		stopEncoders();
+	}
+
+	// Create the pixel pack buffers (sized on first use) and start the encoder threads
+	void create(int encoderCnt);
+
+	// Write the next drawn frame to a PNG file
+	void requestScreenshot(string filename) {
+		screenshotFile = filename;
+	}
+
+	// Record every drawn frame, either as numbered PNGs (prefix_00000.png, ...) or appended to prefix.rgba
+	void startRecording(string prefix, bool raw);
+
+	void stopRecording();
+
+	bool isRecording() {
+		return recording;
+	}
+
+	// Are readbacks still in flight? (the caller should keep calling collect())
+	bool busy();
+
+	// Call after drawing a frame and before swapping buffers: start reading it back if anything wants it
+	void captureFrame(int width, int height);
+
+	// Call every iteration: hand readbacks the GPU has finished to the encoders, oldest first (never waits)
+	void collect();
+
+	// Finish everything still in flight or queued, then delete the buffers
+	void cleanup();
+
+private:
+	struct Readback {
+		GLuint pbo = 0;
+		GLsizeiptr capacity = 0;
+		GLsync fence = nullptr;
+		int width = 0;
+		int height = 0;
+		string screenshotFile;
+		string recordFile;
+		shared_ptr<RawStream> rawStream;
+		long rawFrame = -1;
+	};
+
+	struct EncodeJob {
+		vector<unsigned char> pixels;		// Top row first
+		int width = 0;
+		int height = 0;
+		string screenshotFile;
+		string recordFile;
+		shared_ptr<RawStream> rawStream;
+		long rawFrame = -1;
+	};
+
+	int queuedFrames() {
+		lock_guard<mutex> guard(queueMutex);
+		return (int)jobs.size();
+	}
+
+	// Copy a finished readback out of its buffer (flipping it, since GL rows start at the bottom) and queue it
+	void collectSlot(Readback &rb, bool wait);
+
+	void encoderLoop();
+
+	void stopEncoders();
+
+	Readback ring[CAPTURE_RING_SIZE];
+	int next = 0;
+
+	string screenshotFile;
+	bool recording = false;
+	string recordPrefix;
+	long recordFrame = 0;
+	unsigned long droppedFrames = 0;
+	int recordWidth = 0;
+	int recordHeight = 0;
+	shared_ptr<RawStream> rawStream;
+
+	vector<thread> encoders;
+	mutex queueMutex;
+	condition_variable jobCV;
+	deque<EncodeJob> jobs;
+	vector<vector<unsigned char>> spareBuffers;
+	bool quitting = false;
+};
@@ -0,0 +1,591 @@
+#include "SceneBVH.h"
+
+glm::vec3 closestPointOnTriangle(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+	glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+	if(d1 <= 0.0f && d2 <= 0.0f) return a;
+
+	glm::vec3 bp = p - b;
+	float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+	if(d3 >= 0.0f && d4 <= d3) return b;
+
+	float vc = d1*d4 - d3*d2;
+	if(vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab*(d1 / (d1 - d3));
+
+	glm::vec3 cp = p - c;
+	float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+	if(d6 >= 0.0f && d5 <= d6) return c;
+
+	float vb = d5*d2 - d1*d6;
+	if(vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac*(d2 / (d2 - d6));
+
+	float va = d3*d6 - d5*d4;
+	if(va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) return b + (c - b)*((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+	float denom = 1.0f / (va + vb + vc);
+	return a + ab*(vb*denom) + ac*(vc*denom);
+}
+
+void SceneBVH::addMesh(int meshIndex, Mesh &m) {
+	if(meshIndex >= meshes.size()) meshes.resize(meshIndex + 1);
+	BVHMesh &bm = meshes[meshIndex];
+	bm.positions.resize(m.vertices.size());
+	for(int i = 0; i < m.vertices.size(); i++) {
+		bm.positions[i] = m.vertices[i].position;
+	}
+	bm.indices.assign(m.indices.begin(), m.indices.end());
+}
+
+void SceneBVH::build(vector<SceneNode> &nodes, vector<glm::mat4> &transforms, WorkerPool &pool) {
+	// One instance per mesh per node
+	instances.clear();
+	int triCnt = 0;
+	for(int i = 0; i < nodes.size(); i++) {
+		for(int index : nodes[i].meshIndices) {
+			if(index >= meshes.size()) continue;
+			instances.push_back({ i, index, triCnt });
+			triCnt += (int)meshes[index].indices.size() / 3;
+		}
+	}
+
+	triVerts.resize(triCnt*3);
+	triIndices.resize(triCnt);
+	transformTriangles(transforms, pool);
+
+	// Build-time triangle bounds, kept contiguous and partitioned in place so binning reads memory in order
+	buildRefs.resize(triCnt);
+	pool.parallelFor((triCnt + 4095) / 4096, [&](int c) {
+		for(int tri = c*4096; tri < min(triCnt, (c + 1)*4096); tri++) {
+			TriRef &ref = buildRefs[tri];
+			ref.boundsMin = glm::min(triVerts[tri*3], glm::min(triVerts[tri*3 + 1], triVerts[tri*3 + 2]));
+			ref.boundsMax = glm::max(triVerts[tri*3], glm::max(triVerts[tri*3 + 1], triVerts[tri*3 + 2]));
+			ref.tri = tri;
+		}
+	});
+
+	bvhNodes.clear();
+	if(triCnt == 0) return;
+	BVHNode root;
+	root.first = 0;
+	root.count = triCnt;
+	root.boundsMin = glm::vec3(numeric_limits<float>::max());
+	root.boundsMax = glm::vec3(-numeric_limits<float>::max());
+	for(TriRef &ref : buildRefs) {
+		root.boundsMin = glm::min(root.boundsMin, ref.boundsMin);
+		root.boundsMax = glm::max(root.boundsMax, ref.boundsMax);
+	}
+	bvhNodes.push_back(root);
+
+	// Split the top of the tree serially (biggest nodes first) until there is enough independent work
+	vector<int> pending;
+	vector<bool> unsplittable;		// Per pending node: split() already gave up on it
+	pending.push_back(0);
+	unsplittable.push_back(false);
+	int wanted = 8*(pool.threadCount() + 1);
+	while(pending.size() < wanted) {
+		int biggest = -1;
+		for(int i = 0; i < pending.size(); i++) {
+			if(!unsplittable[i] && bvhNodes[pending[i]].count > MAX_LEAF_SIZE*16 && (biggest < 0 || bvhNodes[pending[i]].count > bvhNodes[pending[biggest]].count)) {
+				biggest = i;
+			}
+		}
+		if(biggest < 0) break;
+
+		int index = pending[biggest];
+		if(!split(bvhNodes, index, &pool)) {
+			// Couldn't split; leave as a subtree task and keep splitting the others
+			unsplittable[biggest] = true;
+			continue;
+		}
+		int left = bvhNodes[index].left;
+		pending[biggest] = left;
+		pending.push_back(left + 1);
+		unsplittable.push_back(false);
+	}
+
+	// Build the remaining subtrees in parallel, each into its own node list
+	vector<vector<BVHNode>> subtrees(pending.size());
+	pool.parallelFor((int)pending.size(), [&](int i) {
+		vector<BVHNode> &local = subtrees[i];
+		local.push_back(bvhNodes[pending[i]]);
+		vector<int> stack;
+		stack.push_back(0);
+		while(!stack.empty()) {
+			int index = stack.back();
+			stack.pop_back();
+			if(split(local, index, nullptr)) {
+				stack.push_back(local[index].left);
+				stack.push_back(local[index].left + 1);
+			}
+		}
+	});
+
+	for(int i = 0; i < triCnt; i++) triIndices[i] = buildRefs[i].tri;
+	vector<TriRef>().swap(buildRefs);
+
+	// Stitch subtrees in: local node 0 replaces the pending node, the rest are appended
+	for(int i = 0; i < pending.size(); i++) {
+		vector<BVHNode> &local = subtrees[i];
+		int base = (int)bvhNodes.size() - 1;
+		for(int k = 0; k < local.size(); k++) {
+			BVHNode n = local[k];
+			if(n.count == 0) n.left += base;
+			if(k == 0) bvhNodes[pending[i]] = n;
+			else bvhNodes.push_back(n);
+		}
+	}
+
+	// Update memory accounting
+	size_t bytes = bvhNodes.capacity()*sizeof(BVHNode) + triVerts.capacity()*sizeof(glm::vec3)
+		+ triIndices.capacity()*sizeof(int);
+	for(BVHMesh &bm : meshes) {
+		bytes += bm.positions.capacity()*sizeof(glm::vec3) + bm.indices.capacity()*sizeof(unsigned int);
+	}
+	trackFree(MEM_HOST, MEM_BVH, trackedBytes);
+	trackAlloc(MEM_HOST, MEM_BVH, bytes);
+	trackedBytes = bytes;
+}
+
+void SceneBVH::refit(vector<glm::mat4> &transforms, WorkerPool &pool) {
+	if(bvhNodes.empty()) return;
+	transformTriangles(transforms, pool);
+
+	// Children are always stored after their parent, so a reverse pass visits children first
+	for(int i = (int)bvhNodes.size() - 1; i >= 0; i--) {
+		BVHNode &n = bvhNodes[i];
+		if(n.count > 0) {
+			updateBounds(n);
+		}
+		else {
+			n.boundsMin = glm::min(bvhNodes[n.left].boundsMin, bvhNodes[n.left + 1].boundsMin);
+			n.boundsMax = glm::max(bvhNodes[n.left].boundsMax, bvhNodes[n.left + 1].boundsMax);
+		}
+	}
+}
+
+bool SceneBVH::rayCast(glm::vec3 origin, glm::vec3 dir, RayHit &hit) {
+	if(bvhNodes.empty()) return false;
+	glm::vec3 invDir = glm::vec3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	int bestTri = -1;
+
+	vector<int> stack;
+	stack.reserve(64);
+	stack.push_back(0);
+	while(!stack.empty()) {
+		BVHNode &n = bvhNodes[stack.back()];
+		stack.pop_back();
+		if(rayBoxDistance(origin, invDir, n.boundsMin, n.boundsMax) >= hit.t) continue;
+
+		if(n.count > 0) {
+			for(int i = n.first; i < n.first + n.count; i++) {
+				int tri = triIndices[i];
+				float t = rayTriangle(origin, dir, triVerts[tri*3], triVerts[tri*3 + 1], triVerts[tri*3 + 2]);
+				if(t > 0.0f && t < hit.t) {
+					hit.t = t;
+					bestTri = tri;
+				}
+			}
+		}
+		else {
+			// Visit the nearer child first
+			int nearChild = n.left, farChild = n.left + 1;
+			float nearDist = rayBoxDistance(origin, invDir, bvhNodes[nearChild].boundsMin, bvhNodes[nearChild].boundsMax);
+			float farDist = rayBoxDistance(origin, invDir, bvhNodes[farChild].boundsMin, bvhNodes[farChild].boundsMax);
+			if(farDist < nearDist) {
+				swap(nearChild, farChild);
+				swap(nearDist, farDist);
+			}
+			if(farDist < hit.t) stack.push_back(farChild);
+			if(nearDist < hit.t) stack.push_back(nearChild);
+		}
+	}
+
+	if(bestTri < 0) return false;
+	hit.position = origin + dir*hit.t;
+	fillHitInfo(bestTri, hit.node, hit.mesh, hit.triangle);
+	return true;
+}
+
+bool SceneBVH::closestPoint(glm::vec3 p, PointHit &hit) {
+	if(bvhNodes.empty()) return false;
+	float bestDist2 = hit.distance*hit.distance;
+	int bestTri = -1;
+
+	vector<int> stack;
+	stack.reserve(64);
+	stack.push_back(0);
+	while(!stack.empty()) {
+		BVHNode &n = bvhNodes[stack.back()];
+		stack.pop_back();
+		if(pointBoxDistance2(p, n.boundsMin, n.boundsMax) >= bestDist2) continue;
+
+		if(n.count > 0) {
+			for(int i = n.first; i < n.first + n.count; i++) {
+				int tri = triIndices[i];
+				glm::vec3 q = closestPointOnTriangle(p, triVerts[tri*3], triVerts[tri*3 + 1], triVerts[tri*3 + 2]);
+				float dist2 = glm::dot(q - p, q - p);
+				if(dist2 < bestDist2) {
+					bestDist2 = dist2;
+					bestTri = tri;
+					hit.position = q;
+				}
+			}
+		}
+		else {
+			// Visit the nearer child first
+			int nearChild = n.left, farChild = n.left + 1;
+			float nearDist = pointBoxDistance2(p, bvhNodes[nearChild].boundsMin, bvhNodes[nearChild].boundsMax);
+			float farDist = pointBoxDistance2(p, bvhNodes[farChild].boundsMin, bvhNodes[farChild].boundsMax);
+			if(farDist < nearDist) {
+				swap(nearChild, farChild);
+				swap(nearDist, farDist);
+			}
+			if(farDist < bestDist2) stack.push_back(farChild);
+			if(nearDist < bestDist2) stack.push_back(nearChild);
+		}
+	}
+
+	if(bestTri < 0) return false;
+	hit.distance = sqrt(bestDist2);
+	fillHitInfo(bestTri, hit.node, hit.mesh, hit.triangle);
+	return true;
+}
+
+bool SceneBVH::rayCastBruteForce(glm::vec3 origin, glm::vec3 dir, RayHit &hit) {
+	int bestTri = -1;
+	for(int tri = 0; tri < triVerts.size() / 3; tri++) {
+		float t = rayTriangle(origin, dir, triVerts[tri*3], triVerts[tri*3 + 1], triVerts[tri*3 + 2]);
+		if(t > 0.0f && t < hit.t) {
+			hit.t = t;
+			bestTri = tri;
+		}
+	}
+
+	if(bestTri < 0) return false;
+	hit.position = origin + dir*hit.t;
+	fillHitInfo(bestTri, hit.node, hit.mesh, hit.triangle);
+	return true;
+}
+
+bool SceneBVH::closestPointBruteForce(glm::vec3 p, PointHit &hit) {
+	float bestDist2 = hit.distance*hit.distance;
+	int bestTri = -1;
+	for(int tri = 0; tri < triVerts.size() / 3; tri++) {
+		glm::vec3 q = closestPointOnTriangle(p, triVerts[tri*3], triVerts[tri*3 + 1], triVerts[tri*3 + 2]);
+		float dist2 = glm::dot(q - p, q - p);
+		if(dist2 < bestDist2) {
+			bestDist2 = dist2;
+			bestTri = tri;
+			hit.position = q;
+		}
+	}
+
+	if(bestTri < 0) return false;
+	hit.distance = sqrt(bestDist2);
+	fillHitInfo(bestTri, hit.node, hit.mesh, hit.triangle);
+	return true;
+}
+
+void SceneBVH::swapWith(SceneBVH &other) {
+	meshes.swap(other.meshes);
+	instances.swap(other.instances);
+	bvhNodes.swap(other.bvhNodes);
+	triVerts.swap(other.triVerts);
+	triIndices.swap(other.triIndices);
+	std::swap(trackedBytes, other.trackedBytes);
+}
+
+void SceneBVH::transformTriangles(vector<glm::mat4> &transforms, WorkerPool &pool) {
+	pool.parallelFor((int)instances.size(), [&](int i) {
+		BVHInstance &inst = instances[i];
+		BVHMesh &bm = meshes[inst.mesh];
+		glm::mat4 &M = transforms[inst.node];
+		for(int t = 0; t < bm.indices.size() / 3; t++) {
+			int tri = inst.triBase + t;
+			for(int k = 0; k < 3; k++) {
+				triVerts[tri*3 + k] = glm::vec3(M * glm::vec4(bm.positions[bm.indices[t*3 + k]], 1.0));
+			}
+		}
+	});
+}
+
+void SceneBVH::updateBounds(BVHNode &n) {
+	n.boundsMin = glm::vec3(numeric_limits<float>::max());
+	n.boundsMax = glm::vec3(-numeric_limits<float>::max());
+	for(int i = n.first; i < n.first + n.count; i++) {
+		int tri = triIndices[i];
+		for(int k = 0; k < 3; k++) {
+			n.boundsMin = glm::min(n.boundsMin, triVerts[tri*3 + k]);
+			n.boundsMax = glm::max(n.boundsMax, triVerts[tri*3 + k]);
+		}
+	}
+}
+
+bool SceneBVH::split(vector<BVHNode> &nodes, int index, WorkerPool *pool) {
+	int first = nodes[index].first;
+	int count = nodes[index].count;
+	if(count <= 2) return false;
+
+	glm::vec3 cMin = glm::vec3(numeric_limits<float>::max());
+	glm::vec3 cMax = glm::vec3(-numeric_limits<float>::max());
+	for(int i = first; i < first + count; i++) {
+		glm::vec3 c = buildRefs[i].centroid();
+		cMin = glm::min(cMin, c);
+		cMax = glm::max(cMax, c);
+	}
+
+	// Bin centroids along all three axes
+	Bin bins[3][BIN_CNT];
+	glm::vec3 scale;
+	for(int axis = 0; axis < 3; axis++) {
+		float extent = cMax[axis] - cMin[axis];
+		scale[axis] = extent > 0.0f ? BIN_CNT / extent : 0.0f;
+	}
+	auto binRange = [&](int start, int end, Bin (&out)[3][BIN_CNT]) {
+		for(int i = start; i < end; i++) {
+			TriRef &ref = buildRefs[i];
+			glm::vec3 c = ref.centroid();
+			for(int axis = 0; axis < 3; axis++) {
+				if(scale[axis] == 0.0f) continue;
+				int b = min(BIN_CNT - 1, (int)((c[axis] - cMin[axis])*scale[axis]));
+				Bin &bin = out[axis][b];
+				bin.count++;
+				bin.boundsMin = glm::min(bin.boundsMin, ref.boundsMin);
+				bin.boundsMax = glm::max(bin.boundsMax, ref.boundsMax);
+			}
+		}
+	};
+	const int CHUNK = 65536;
+	if(pool && count > 2*CHUNK) {
+		int chunkCnt = (count + CHUNK - 1) / CHUNK;
+		vector<array<array<Bin, BIN_CNT>, 3>> partial(chunkCnt);
+		pool->parallelFor(chunkCnt, [&](int c) {
+			Bin local[3][BIN_CNT];
+			binRange(first + c*CHUNK, min(first + count, first + (c + 1)*CHUNK), local);
+			for(int axis = 0; axis < 3; axis++) {
+				for(int b = 0; b < BIN_CNT; b++) partial[c][axis][b] = local[axis][b];
+			}
+		});
+		for(int c = 0; c < chunkCnt; c++) {
+			for(int axis = 0; axis < 3; axis++) {
+				for(int b = 0; b < BIN_CNT; b++) {
+					Bin &src = partial[c][axis][b];
+					bins[axis][b].count += src.count;
+					bins[axis][b].boundsMin = glm::min(bins[axis][b].boundsMin, src.boundsMin);
+					bins[axis][b].boundsMax = glm::max(bins[axis][b].boundsMax, src.boundsMax);
+				}
+			}
+		}
+	}
+	else {
+		binRange(first, first + count, bins);
+	}
+
+	// Sweep split planes between bins and keep the cheapest
+	// (the accumulated bin bounds are exactly the child bounds, so they are kept for the winner)
+	float bestCost = numeric_limits<float>::max();
+	int bestAxis = -1, bestSplit = -1;
+	Bin bestLeft, bestRight;
+	for(int axis = 0; axis < 3; axis++) {
+		if(scale[axis] == 0.0f) continue;
+		Bin right[BIN_CNT];
+		Bin acc;
+		for(int b = BIN_CNT - 1; b > 0; b--) {
+			acc.count += bins[axis][b].count;
+			acc.boundsMin = glm::min(acc.boundsMin, bins[axis][b].boundsMin);
+			acc.boundsMax = glm::max(acc.boundsMax, bins[axis][b].boundsMax);
+			right[b] = acc;
+		}
+		acc = Bin();
+		for(int b = 0; b < BIN_CNT - 1; b++) {
+			acc.count += bins[axis][b].count;
+			acc.boundsMin = glm::min(acc.boundsMin, bins[axis][b].boundsMin);
+			acc.boundsMax = glm::max(acc.boundsMax, bins[axis][b].boundsMax);
+			if(acc.count == 0 || right[b + 1].count == 0) continue;
+			float cost = acc.count*area(acc.boundsMin, acc.boundsMax) + right[b + 1].count*area(right[b + 1].boundsMin, right[b + 1].boundsMax);
+			if(cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+				bestLeft = acc;
+				bestRight = right[b + 1];
+			}
+		}
+	}
+
+	// Not worth splitting (or all centroids coincide); a split also pays for visiting one more node
+	float nodeArea = area(nodes[index].boundsMin, nodes[index].boundsMax);
+	float leafCost = count*nodeArea;
+	if(bestAxis < 0 || (bestCost + TRAVERSAL_COST*nodeArea >= leafCost && count <= MAX_LEAF_SIZE)) return false;
+
+	// Partition triangles around the chosen plane
+	int mid = first;
+	for(int i = first; i < first + count; i++) {
+		int b = min(BIN_CNT - 1, (int)((buildRefs[i].centroid()[bestAxis] - cMin[bestAxis])*scale[bestAxis]));
+		if(b <= bestSplit) swap(buildRefs[i], buildRefs[mid++]);
+	}
+	if(mid == first || mid == first + count) return false;
+
+	BVHNode leftNode, rightNode;
+	leftNode.first = first;
+	leftNode.count = mid - first;
+	rightNode.first = mid;
+	rightNode.count = first + count - mid;
+	leftNode.boundsMin = bestLeft.boundsMin;
+	leftNode.boundsMax = bestLeft.boundsMax;
+	rightNode.boundsMin = bestRight.boundsMin;
+	rightNode.boundsMax = bestRight.boundsMax;
+
+	nodes[index].left = (int)nodes.size();
+	nodes[index].count = 0;
+	nodes.push_back(leftNode);
+	nodes.push_back(rightNode);
+	return true;
+}
+
+float SceneBVH::rayBoxDistance(glm::vec3 origin, glm::vec3 invDir, glm::vec3 lo, glm::vec3 hi) {
+	float tMin = 0.0f, tMax = numeric_limits<float>::max();
+	for(int axis = 0; axis < 3; axis++) {
+		// Parallel to this slab: inside it or a miss (the products below would be 0*inf = NaN on its faces)
+		if(isinf(invDir[axis])) {
+			if(origin[axis] < lo[axis] || origin[axis] > hi[axis]) return numeric_limits<float>::max();
+			continue;
+		}
+		float t0 = (lo[axis] - origin[axis])*invDir[axis];
+		float t1 = (hi[axis] - origin[axis])*invDir[axis];
+		if(t0 > t1) swap(t0, t1);
+		tMin = max(tMin, t0);
+		tMax = min(tMax, t1);
+	}
+	return (tMin <= tMax) ? tMin : numeric_limits<float>::max();
+}
+
+float SceneBVH::rayTriangle(glm::vec3 origin, glm::vec3 dir, glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+	glm::vec3 e1 = b - a, e2 = c - a;
+	glm::vec3 pv = glm::cross(dir, e2);
+	float det = glm::dot(e1, pv);
+	if(fabs(det) < 1e-12f) return -1.0f;
+	float invDet = 1.0f / det;
+	glm::vec3 tv = origin - a;
+	float u = glm::dot(tv, pv)*invDet;
+	if(u < 0.0f || u > 1.0f) return -1.0f;
+	glm::vec3 qv = glm::cross(tv, e1);
+	float v = glm::dot(dir, qv)*invDet;
+	if(v < 0.0f || u + v > 1.0f) return -1.0f;
+	return glm::dot(e2, qv)*invDet;
+}
+
+void SceneBVH::fillHitInfo(int tri, int &node, int &mesh, int &triangle) {
+	// Instances are sorted by triBase, so find the last one starting at or before tri
+	int lo = 0, hi = (int)instances.size() - 1;
+	while(lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if(instances[mid].triBase <= tri) lo = mid;
+		else hi = mid - 1;
+	}
+	node = instances[lo].node;
+	mesh = instances[lo].mesh;
+	triangle = tri - instances[lo].triBase;
+}
+
+// Run queryCnt random ray casts and closest point queries through the BVH and by brute force; returns the number
+// of queries whose results differ (ties between triangles at the same distance are fine, so only distances count)
+int compareBVHQueries(SceneBVH &bvh, glm::vec3 sceneMin, glm::vec3 sceneMax, int queryCnt) {
+	mt19937 rng(450);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	uniform_real_distribution<float> signedUnit(-1.0f, 1.0f);
+
+	// Query points are spread over the scene bounds and a margin around them
+	glm::vec3 margin = (sceneMax - sceneMin)*0.25f + glm::vec3(0.01f);
+	glm::vec3 lo = sceneMin - margin, hi = sceneMax + margin;
+	vector<glm::vec3> points(queryCnt);
+	vector<glm::vec3> dirs(queryCnt);
+	for(int i = 0; i < queryCnt; i++) {
+		points[i] = lo + (hi - lo)*glm::vec3(unit(rng), unit(rng), unit(rng));
+		dirs[i] = glm::normalize(glm::vec3(signedUnit(rng), signedUnit(rng), signedUnit(rng)) + glm::vec3(0.0f, 0.0f, 0.001f));
+	}
+	// A few rays along the axes, which exercise the parallel-slab case of the box test
+	for(int i = 0; i < queryCnt && i < 6; i++) {
+		dirs[i] = glm::vec3(0.0f);
+		dirs[i][i % 3] = (i < 3) ? 1.0f : -1.0f;
+	}
+
+	vector<RayHit> rayHits(queryCnt), rayRefs(queryCnt);
+	vector<PointHit> pointHits(queryCnt), pointRefs(queryCnt);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for(int i = 0; i < queryCnt; i++) {
+		bvh.rayCast(points[i], dirs[i], rayHits[i]);
+		bvh.closestPoint(points[i], pointHits[i]);
+	}
+	double bvhMS = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	start = chrono::steady_clock::now();
+	for(int i = 0; i < queryCnt; i++) {
+		bvh.rayCastBruteForce(points[i], dirs[i], rayRefs[i]);
+		bvh.closestPointBruteForce(points[i], pointRefs[i]);
+	}
+	double bruteMS = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	int rayMismatches = 0, pointMismatches = 0, rayHitCnt = 0;
+	for(int i = 0; i < queryCnt; i++) {
+		if(rayRefs[i].triangle >= 0) rayHitCnt++;
+		if(rayHits[i].t != rayRefs[i].t) rayMismatches++;
+		if(pointHits[i].distance != pointRefs[i].distance) pointMismatches++;
+	}
+	cout << "  Ray casts: " << rayHitCnt << " of " << queryCnt << " hit, " << rayMismatches << " mismatches" << endl;
+	cout << "  Closest points: " << pointMismatches << " mismatches" << endl;
+	cout << "  BVH: " << queryCnt*2 / (bvhMS / 1000.0) << " queries/sec" << endl;
+	cout << "  Brute force: " << queryCnt*2 / (bruteMS / 1000.0) << " queries/sec (" << bruteMS / bvhMS << "x slower)" << endl;
+	return rayMismatches + pointMismatches;
+}
+
+int runBVHTest(const aiScene *scene, int queryCnt) {
+	SceneBVH bvh;
+	for(int i = 0; i < scene->mNumMeshes; i++) {
+		Mesh m;
+		extractMeshData(scene->mMeshes[i], m);
+		bvh.addMesh(i, m);
+	}
+	vector<SceneNode> sceneNodes;
+	flattenScene(scene->mRootNode, glm::mat4(1.0), sceneNodes);
+
+	unsigned int hwThreads = thread::hardware_concurrency();
+	WorkerPool workerPool(hwThreads > 1 ? hwThreads - 1 : 0);
+
+	vector<glm::mat4> transforms(sceneNodes.size());
+	for(int i = 0; i < sceneNodes.size(); i++) transforms[i] = nodeWorldMatrix(sceneNodes[i]);
+	bvh.build(sceneNodes, transforms, workerPool);
+	cout << "BVH: " << bvh.triangleCount() << " triangles, " << bvh.nodeCount() << " nodes" << endl;
+	if(bvh.triangleCount() == 0) {
+		cout << "ERROR: The scene has no triangles" << endl;
+		return EXIT_FAILURE;
+	}
+
+	// Query around the scene's world-space bounds (the union of the node bounds)
+	glm::vec3 sceneMin(numeric_limits<float>::max()), sceneMax(-numeric_limits<float>::max());
+	for(int i = 0; i < sceneNodes.size(); i++) {
+		for(int index : sceneNodes[i].meshIndices) {
+			aiMesh *mesh = scene->mMeshes[index];
+			for(int v = 0; v < mesh->mNumVertices; v++) {
+				aiVector3D &p = mesh->mVertices[v];
+				glm::vec3 world = glm::vec3(transforms[i] * glm::vec4(p.x, p.y, p.z, 1.0));
+				sceneMin = glm::min(sceneMin, world);
+				sceneMax = glm::max(sceneMax, world);
+			}
+		}
+	}
+
+	cout << "As built:" << endl;
+	int mismatches = compareBVHQueries(bvh, sceneMin, sceneMax, queryCnt);
+
+	// Rotate the nodes as J does and refit; the same queries must still agree with brute force
+	rotAngle += 30.0f;
+	for(int i = 0; i < sceneNodes.size(); i++) transforms[i] = nodeWorldMatrix(sceneNodes[i]);
+	bvh.refit(transforms, workerPool);
+	cout << "After refit:" << endl;
+	mismatches += compareBVHQueries(bvh, sceneMin, sceneMax, queryCnt);
+	rotAngle -= 30.0f;
+
+	cout << (mismatches == 0 ? "PASSED" : "FAILED") << endl;
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
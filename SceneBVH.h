@@ -0,0 +1,143 @@
+#pragma once
+
+#include "BasicGraphics.h"
+
+// Result of a ray cast against the scene BVH
+struct RayHit {
+	float t = numeric_limits<float>::max();
+	glm::vec3 position;
+	int node = -1;			// Index into the scene node list
+	int mesh = -1;
+	int triangle = -1;
+};
+
+// Result of a closest point query against the scene BVH
+struct PointHit {
+	float distance = numeric_limits<float>::max();
+	glm::vec3 position;
+	int node = -1;
+	int mesh = -1;
+	int triangle = -1;
+};
+
+// Closest point to p on triangle abc (from Ericson, Real-Time Collision Detection, 5.1.5)
+glm::vec3 closestPointOnTriangle(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c);
+
+// Bounding volume hierarchy over every triangle of every scene node, in world space.
+// Built with binned SAH; the top of the tree is split serially and the subtrees below are built in parallel.
+// refit() updates bounds in place after node transforms change (the tree topology is kept).
+class SceneBVH {
+public:
+	static const int BIN_CNT = 16;
+	static const int MAX_LEAF_SIZE = 8;
+	static constexpr float TRAVERSAL_COST = 1.0f;		// Cost of a node visit relative to one triangle test
+
+	~SceneBVH() {
+		trackFree(MEM_HOST, MEM_BVH, trackedBytes);
+	}
+
+	// Keep a copy of a mesh's positions and indices: refit() re-transforms them, and the Mesh itself only lives
+	// in the load arena until it is uploaded (this is 12 bytes per vertex and per triangle, a fraction of the Mesh)
+	void addMesh(int meshIndex, Mesh &m);
+
+	// Build the tree; transforms[i] is the current world matrix of nodes[i]
+	void build(vector<SceneNode> &nodes, vector<glm::mat4> &transforms, WorkerPool &pool);
+
+	// Recompute world-space triangles and node bounds for new transforms
+	void refit(vector<glm::mat4> &transforms, WorkerPool &pool);
+
+	// Find the closest triangle hit by the ray origin + t*dir (t > 0)
+	bool rayCast(glm::vec3 origin, glm::vec3 dir, RayHit &hit);
+
+	// Find the point on the scene closest to p (only points nearer than hit.distance count)
+	bool closestPoint(glm::vec3 p, PointHit &hit);
+
+	// The same queries tested against every triangle, without the tree (for checking it)
+	bool rayCastBruteForce(glm::vec3 origin, glm::vec3 dir, RayHit &hit);
+	bool closestPointBruteForce(glm::vec3 p, PointHit &hit);
+
+	int nodeCount() {
+		return (int)bvhNodes.size();
+	}
+
+	int triangleCount() {
+		return (int)triIndices.size();
+	}
+
+	// Exchange contents with another BVH (used to swap in one built on a background thread)
+	void swapWith(SceneBVH &other);
+
+private:
+	// Leaf if count > 0 (triangles first..first+count-1), otherwise children are left and left + 1
+	struct BVHNode {
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		int left = 0;
+		int first = 0;
+		int count = 0;
+	};
+
+	struct BVHMesh {
+		vector<glm::vec3> positions;
+		vector<unsigned int> indices;
+	};
+
+	struct BVHInstance {
+		int node;
+		int mesh;
+		int triBase;
+	};
+
+	struct TriRef {
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		int tri;
+
+		glm::vec3 centroid() const { return (boundsMin + boundsMax)*0.5f; }
+	};
+
+	struct Bin {
+		glm::vec3 boundsMin = glm::vec3(numeric_limits<float>::max());
+		glm::vec3 boundsMax = glm::vec3(-numeric_limits<float>::max());
+		int count = 0;
+	};
+
+	vector<BVHMesh> meshes;
+	vector<BVHInstance> instances;
+	vector<BVHNode> bvhNodes;
+	vector<glm::vec3> triVerts;		// 3 world-space vertices per triangle
+	vector<int> triIndices;			// Triangle order referenced by leaves
+	vector<TriRef> buildRefs;		// Only alive during build()
+	size_t trackedBytes = 0;
+
+	void transformTriangles(vector<glm::mat4> &transforms, WorkerPool &pool);
+
+	void updateBounds(BVHNode &n);
+
+	static float area(glm::vec3 lo, glm::vec3 hi) {
+		glm::vec3 e = hi - lo;
+		return e.x*e.y + e.y*e.z + e.z*e.x;
+	}
+
+	// Try to split leaf nodes[index] with binned SAH; appends two children and returns true on success.
+	// With a pool, large ranges are binned in parallel.
+	bool split(vector<BVHNode> &nodes, int index, WorkerPool *pool);
+
+	// Distance along the ray to the box (infinity if missed)
+	static float rayBoxDistance(glm::vec3 origin, glm::vec3 invDir, glm::vec3 lo, glm::vec3 hi);
+
+	// Squared distance from p to the box (0 inside)
+	static float pointBoxDistance2(glm::vec3 p, glm::vec3 lo, glm::vec3 hi) {
+		glm::vec3 d = glm::max(lo - p, glm::max(glm::vec3(0.0f), p - hi));
+		return glm::dot(d, d);
+	}
+
+	// Moller-Trumbore; returns t of the hit or a negative value
+	static float rayTriangle(glm::vec3 origin, glm::vec3 dir, glm::vec3 a, glm::vec3 b, glm::vec3 c);
+
+	void fillHitInfo(int tri, int &node, int &mesh, int &triangle);
+};
+
+// BVH test mode: build the BVH for the scene, then check ray casts and closest point queries against brute force
+// over every triangle (before and after a refit) and report the query throughput of both
+int runBVHTest(const aiScene *scene, int queryCnt);
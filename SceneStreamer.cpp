@@ -0,0 +1,332 @@
+#include "SceneStreamer.h"
+
+// Header of a streaming chunk file.
+// Layout: header | ChunkInfo[chunkCount] | ChunkFileNode[nodeCount] | unsigned int[nodeMeshCount] | chunk data
+// Everything is at a fixed offset, so single chunks can be read (or mapped) without touching the rest of the file.
+struct ChunkFileHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int chunkCount;
+	unsigned int nodeCount;
+	unsigned int nodeMeshCount;
+	unsigned long long sourceSize;		// Size and modification time of the model the file was made from
+	long long sourceTime;
+};
+
+const char CHUNK_FILE_MAGIC[8] = "BGCHUNK";
+const unsigned int CHUNK_FILE_VERSION = 2;
+
+// Node entry in a chunk file; its mesh indices live in the shared index array after the nodes
+struct ChunkFileNode {
+	glm::mat4 modelMat;
+	unsigned int firstMesh;
+	unsigned int meshCount;
+};
+
+// Get the size and modification time of a model file (to tell whether its chunk file is out of date)
+bool getChunkSource(string modelFilename, unsigned long long &size, long long &time) {
+	error_code ec;
+	size = filesystem::file_size(modelFilename, ec);
+	if(ec) return false;
+	filesystem::file_time_type modified = filesystem::last_write_time(modelFilename, ec);
+	if(ec) return false;
+	time = (long long)modified.time_since_epoch().count();
+	return true;
+}
+
+bool chunkFileIsCurrent(string chunkFilename, string modelFilename) {
+	ifstream file(chunkFilename, ios::binary);
+	if(!file) return false;
+
+	ChunkFileHeader header;
+	unsigned long long size;
+	long long time;
+	if(!file.read((char*)&header, sizeof(header))
+		|| memcmp(header.magic, CHUNK_FILE_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != CHUNK_FILE_VERSION
+		|| !getChunkSource(modelFilename, size, time)
+		|| header.sourceSize != size || header.sourceTime != time) {
+		cout << "Chunk file is out of date: " << chunkFilename << endl;
+		return false;
+	}
+	return true;
+}
+
+void writeChunkFile(const aiScene *scene, string filename, string modelFilename) {
+	ofstream file(filename, ios::binary);
+	if(!file) {
+		cerr << "ERROR: Could not open file: " << filename << endl;
+		throw runtime_error("ERROR: Could not open file: " + filename);
+	}
+
+	vector<SceneNode> nodes;
+	flattenScene(scene->mRootNode, glm::mat4(1.0), nodes);
+
+	vector<ChunkFileNode> fileNodes;
+	vector<unsigned int> nodeMeshes;
+	for(SceneNode &sn : nodes) {
+		ChunkFileNode fn;
+		fn.modelMat = sn.modelMat;
+		fn.firstMesh = (unsigned int)nodeMeshes.size();
+		fn.meshCount = (unsigned int)sn.meshIndices.size();
+		nodeMeshes.insert(nodeMeshes.end(), sn.meshIndices.begin(), sn.meshIndices.end());
+		fileNodes.push_back(fn);
+	}
+
+	ChunkFileHeader header;
+	memcpy(header.magic, CHUNK_FILE_MAGIC, sizeof(header.magic));
+	header.version = CHUNK_FILE_VERSION;
+	header.chunkCount = scene->mNumMeshes;
+	header.nodeCount = (unsigned int)fileNodes.size();
+	header.nodeMeshCount = (unsigned int)nodeMeshes.size();
+	header.sourceSize = 0;
+	header.sourceTime = 0;
+	getChunkSource(modelFilename, header.sourceSize, header.sourceTime);
+
+	// Chunk table gets filled in once the data offsets are known
+	vector<ChunkInfo> chunks(scene->mNumMeshes);
+	file.write((char*)&header, sizeof(header));
+	file.write((char*)chunks.data(), sizeof(ChunkInfo)*chunks.size());
+	file.write((char*)fileNodes.data(), sizeof(ChunkFileNode)*fileNodes.size());
+	file.write((char*)nodeMeshes.data(), sizeof(unsigned int)*nodeMeshes.size());
+
+	for(int i = 0; i < scene->mNumMeshes; i++) {
+		// Only one mesh is extracted at a time, so its scratch memory can be reused for the next one
+		ArenaMarker marker;
+		if(loadArena) marker = loadArena->mark();
+
+		Mesh m;
+		extractMeshData(scene->mMeshes[i], m);
+
+		ChunkInfo &info = chunks[i];
+		info.vertexCount = (unsigned int)m.vertices.size();
+		info.indexCount = (unsigned int)m.indices.size();
+		info.boundsMin = glm::vec3(0,0,0);
+		info.boundsMax = glm::vec3(0,0,0);
+		if(!m.vertices.empty()) {
+			info.boundsMin = m.vertices[0].position;
+			info.boundsMax = m.vertices[0].position;
+		}
+		for(Vertex &v : m.vertices) {
+			info.boundsMin = glm::min(info.boundsMin, v.position);
+			info.boundsMax = glm::max(info.boundsMax, v.position);
+		}
+
+		info.vertexOffset = (unsigned long long)file.tellp();
+		file.write((char*)m.vertices.data(), sizeof(Vertex)*m.vertices.size());
+		info.indexOffset = (unsigned long long)file.tellp();
+		file.write((char*)m.indices.data(), sizeof(unsigned int)*m.indices.size());
+
+		// Release m before rewinding the arena underneath it
+		m = Mesh();
+		if(loadArena) loadArena->rewind(marker);
+	}
+
+	file.seekp(sizeof(header));
+	file.write((char*)chunks.data(), sizeof(ChunkInfo)*chunks.size());
+
+	if(!file) {
+		throw runtime_error("ERROR: Could not write chunk file: " + filename);
+	}
+}
+
+void printStreamStats(StreamStats &stats, int chunkCount) {
+	cout << "** STREAMING **" << endl;
+	cout << "Resident chunks: " << stats.residentChunks << " / " << chunkCount << endl;
+	cout << "Loading chunks: " << stats.loadingChunks << endl;
+	cout << "Failed chunks: " << stats.failedChunks << endl;
+	cout << "GPU bytes: " << stats.gpuBytes << endl;
+	cout << "Host bytes: " << stats.hostBytes << endl;
+	cout << "Loads: " << stats.loads << ", evictions: " << stats.evictions << endl;
+}
+
+void SceneStreamer::open(string filename) {
+	ifstream file(filename, ios::binary);
+	ChunkFileHeader header;
+	if(!file || !file.read((char*)&header, sizeof(header))
+		|| memcmp(header.magic, CHUNK_FILE_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != CHUNK_FILE_VERSION) {
+		cerr << "ERROR: Not a valid chunk file: " << filename << endl;
+		throw runtime_error("ERROR: Not a valid chunk file: " + filename);
+	}
+
+	chunks.resize(header.chunkCount);
+	vector<ChunkFileNode> fileNodes(header.nodeCount);
+	vector<unsigned int> nodeMeshes(header.nodeMeshCount);
+	file.read((char*)chunks.data(), sizeof(ChunkInfo)*chunks.size());
+	file.read((char*)fileNodes.data(), sizeof(ChunkFileNode)*fileNodes.size());
+	file.read((char*)nodeMeshes.data(), sizeof(unsigned int)*nodeMeshes.size());
+	if(!file) {
+		throw runtime_error("ERROR: Truncated chunk file: " + filename);
+	}
+
+	// Make sure every chunk's data and every node's mesh list lies within the file
+	file.seekg(0, ios::end);
+	unsigned long long fileSize = (unsigned long long)file.tellg();
+	for(ChunkInfo &info : chunks) {
+		if(info.vertexOffset > fileSize || info.vertexCount*sizeof(Vertex) > fileSize - info.vertexOffset
+			|| info.indexOffset > fileSize || info.indexCount*sizeof(unsigned int) > fileSize - info.indexOffset) {
+			cerr << "ERROR: Chunk data out of range in chunk file: " << filename << endl;
+			throw runtime_error("ERROR: Chunk data out of range in chunk file: " + filename);
+		}
+	}
+	for(ChunkFileNode &fn : fileNodes) {
+		bool valid = fn.firstMesh <= nodeMeshes.size() && fn.meshCount <= nodeMeshes.size() - fn.firstMesh;
+		for(unsigned int i = 0; valid && i < fn.meshCount; i++) {
+			valid = nodeMeshes[fn.firstMesh + i] < chunks.size();
+		}
+		if(!valid) {
+			cerr << "ERROR: Node mesh list out of range in chunk file: " << filename << endl;
+			throw runtime_error("ERROR: Node mesh list out of range in chunk file: " + filename);
+		}
+	}
+
+	nodes.clear();
+	for(ChunkFileNode &fn : fileNodes) {
+		SceneNode sn;
+		sn.modelMat = fn.modelMat;
+		sn.meshIndices.assign(nodeMeshes.begin() + fn.firstMesh, nodeMeshes.begin() + fn.firstMesh + fn.meshCount);
+		nodes.push_back(sn);
+	}
+
+	path = filename;
+	states.assign(chunks.size(), CHUNK_UNLOADED);
+}
+
+void SceneStreamer::start(int threadCnt, size_t gpuBudgetBytes, size_t hostBudgetBytes) {
+	gpuBudget = gpuBudgetBytes;
+	hostBudget = hostBudgetBytes;
+	quitting = false;
+	for(int i = 0; i < threadCnt; i++) {
+		loaders.push_back(thread(&SceneStreamer::loaderLoop, this));
+	}
+}
+
+void SceneStreamer::stop() {
+	{
+		lock_guard<mutex> guard(queueMutex);
+		quitting = true;
+	}
+	requestCV.notify_all();
+	for(thread &t : loaders) {
+		t.join();
+	}
+	loaders.clear();
+}
+
+void SceneStreamer::update(vector<MeshGL> &meshgls, glm::vec3 eye) {
+	meshgls.resize(chunks.size());
+
+	// Upload chunks the loaders have finished reading (chunks that could not be read are given up on)
+	vector<LoadedChunk> finished;
+	{
+		lock_guard<mutex> guard(queueMutex);
+		finished.swap(completed);
+	}
+	for(LoadedChunk &done : finished) {
+		stats.hostBytes -= chunkBytes(done.index);
+		stats.loadingChunks--;
+		if(!done.ok) {
+			states[done.index] = CHUNK_FAILED;
+			stats.failedChunks++;
+			continue;
+		}
+		createMeshGL(done.mesh, meshgls[done.index]);
+		states[done.index] = CHUNK_RESIDENT;
+		stats.gpuBytes += chunkBytes(done.index);
+		stats.residentChunks++;
+		stats.loads++;
+	}
+
+	// Order chunks by the distance from the eye to the closest instance of their bounds
+	vector<float> distances(chunks.size(), numeric_limits<float>::max());
+	for(SceneNode &sn : nodes) {
+		for(int index : sn.meshIndices) {
+			ChunkInfo &info = chunks[index];
+			glm::vec3 center = glm::vec3(sn.modelMat * glm::vec4((info.boundsMin + info.boundsMax) * 0.5f, 1.0));
+			float radius = glm::length(glm::vec3(sn.modelMat * glm::vec4((info.boundsMax - info.boundsMin) * 0.5f, 0.0)));
+			distances[index] = min(distances[index], max(0.0f, glm::distance(eye, center) - radius));
+		}
+	}
+	vector<int> order(chunks.size());
+	for(int i = 0; i < order.size(); i++) order[i] = i;
+	sort(order.begin(), order.end(), [&](int a, int b) { return distances[a] < distances[b]; });
+
+	// The wanted set is the closest run of chunks that fits the budget (always at least the closest one)
+	vector<bool> wanted(chunks.size(), false);
+	size_t wantedBytes = 0;
+	for(int index : order) {
+		if(states[index] == CHUNK_FAILED) continue;
+		if(wantedBytes + chunkBytes(index) > gpuBudget && wantedBytes > 0) break;
+		wanted[index] = true;
+		wantedBytes += chunkBytes(index);
+	}
+
+	// Request wanted chunks closest first, evicting the farthest unwanted ones to make room
+	int evictPos = (int)order.size() - 1;
+	for(int index : order) {
+		if(states[index] == CHUNK_FAILED) continue;
+		if(!wanted[index]) break;
+		if(states[index] != CHUNK_UNLOADED) continue;
+
+		size_t bytes = chunkBytes(index);
+		if(stats.hostBytes > 0 && stats.hostBytes + bytes > hostBudget) break;
+
+		while(stats.gpuBytes + stats.hostBytes + bytes > gpuBudget && evictPos >= 0) {
+			int victim = order[evictPos--];
+			if(wanted[victim] || states[victim] != CHUNK_RESIDENT) continue;
+			cleanupMesh(meshgls[victim]);
+			states[victim] = CHUNK_UNLOADED;
+			stats.gpuBytes -= chunkBytes(victim);
+			stats.residentChunks--;
+			stats.evictions++;
+		}
+		if(stats.gpuBytes + stats.hostBytes + bytes > gpuBudget && stats.residentChunks + stats.loadingChunks > 0) break;
+
+		states[index] = CHUNK_LOADING;
+		stats.hostBytes += bytes;
+		stats.loadingChunks++;
+		{
+			lock_guard<mutex> guard(queueMutex);
+			requests.push_back(index);
+		}
+		requestCV.notify_one();
+	}
+}
+
+void SceneStreamer::loaderLoop() {
+	ifstream file(path, ios::binary);
+	while(true) {
+		int index;
+		{
+			unique_lock<mutex> lock(queueMutex);
+			requestCV.wait(lock, [this] { return quitting || !requests.empty(); });
+			if(quitting) return;
+			index = requests.front();
+			requests.pop_front();
+		}
+
+		ChunkInfo &info = chunks[index];
+		Mesh m;
+		m.vertices.resize(info.vertexCount);
+		m.indices.resize(info.indexCount);
+		file.seekg(info.vertexOffset);
+		file.read((char*)m.vertices.data(), sizeof(Vertex)*m.vertices.size());
+		file.seekg(info.indexOffset);
+		file.read((char*)m.indices.data(), sizeof(unsigned int)*m.indices.size());
+		bool ok = (bool)file;
+		if(!ok) {
+			cerr << "ERROR: Could not read chunk " << index << " from " << path << endl;
+			file.clear();
+			m = Mesh();
+		}
+
+		{
+			lock_guard<mutex> guard(queueMutex);
+			completed.push_back(LoadedChunk{ index, std::move(m), ok });
+		}
+
+		// Wake the render thread in case it is waiting for events (--on-demand)
+		glfwPostEmptyEvent();
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "BasicGraphics.h"
+
+// Table entry for one chunk (one mesh and its bounds) in a chunk file
+struct ChunkInfo {
+	unsigned long long vertexOffset;
+	unsigned long long indexOffset;
+	unsigned int vertexCount;
+	unsigned int indexCount;
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+};
+
+// Does the chunk file exist and was it made from the current version of the model?
+bool chunkFileIsCurrent(string chunkFilename, string modelFilename);
+
+// Preprocess an imported scene into a chunk file, extracting one mesh at a time
+void writeChunkFile(const aiScene *scene, string filename, string modelFilename);
+
+// Residency state of one streamed chunk
+enum ChunkState { CHUNK_UNLOADED, CHUNK_LOADING, CHUNK_RESIDENT, CHUNK_FAILED };
+
+// Residency statistics for streaming mode
+struct StreamStats {
+	int residentChunks = 0;
+	int loadingChunks = 0;
+	int failedChunks = 0;		// Chunks that could not be read (not retried)
+	size_t gpuBytes = 0;		// Chunks uploaded to the GPU
+	size_t hostBytes = 0;		// Chunks being read or waiting for upload
+	unsigned long loads = 0;
+	unsigned long evictions = 0;
+};
+
+// Print out streaming residency statistics
+void printStreamStats(StreamStats &stats, int chunkCount);
+
+// Streams chunks of a chunk file in and out of GPU memory by distance to the camera.
+// Chunks are read on background threads; uploads and evictions happen on the OpenGL thread in update().
+class SceneStreamer {
+public:
+	vector<ChunkInfo> chunks;
+	vector<SceneNode> nodes;
+	StreamStats stats;
+
+	~SceneStreamer() {
+		stop();
+	}
+
+	// Read the chunk table and node list (but no chunk data) from a chunk file
+	void open(string filename);
+
+	// Start loader threads; budgets are in bytes
+	void start(int threadCnt, size_t gpuBudgetBytes, size_t hostBudgetBytes);
+
+	// Stop loader threads (chunks still queued are dropped)
+	void stop();
+
+	// Upload finished chunks, then evict and request chunks so the closest ones fit in the GPU budget
+	void update(vector<MeshGL> &meshgls, glm::vec3 eye);
+
+private:
+	string path;
+	vector<ChunkState> states;
+	size_t gpuBudget = 0;
+	size_t hostBudget = 0;
+
+	vector<thread> loaders;
+	mutex queueMutex;
+	condition_variable requestCV;
+	deque<int> requests;
+	bool quitting = false;
+
+	// A chunk read by a loader thread, waiting for upload
+	struct LoadedChunk {
+		int index;
+		Mesh mesh;
+		bool ok;
+	};
+	vector<LoadedChunk> completed;
+
+	// Size of a chunk's vertex and index data (same on host and GPU)
+	size_t chunkBytes(int index) {
+		return chunks[index].vertexCount*sizeof(Vertex) + chunks[index].indexCount*sizeof(unsigned int);
+	}
+
+	void loaderLoop();
+};
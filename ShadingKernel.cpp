@@ -0,0 +1,328 @@
+#include "ShadingKernel.h"
+
+// CPU versions of the lighting functions in Basic.fs
+const float PI = 3.14159265359f;
+
+glm::vec3 getFresnelAtAngleZero(glm::vec3 albedo, float metallic) {
+	glm::vec3 F0 = glm::vec3(0.04f);
+	F0 = glm::mix(F0, albedo, metallic);
+	return F0;
+}
+
+glm::vec3 getFresnel(glm::vec3 F0, glm::vec3 L, glm::vec3 H) {
+	float cosAngle = max(0.0f, glm::dot(L, H));
+	glm::vec3 RF = F0 + ((1.0f - F0)*pow(1.0f - cosAngle, 5.0f));
+	return RF;
+}
+
+float getNDF(glm::vec3 H, glm::vec3 N, float roughness) {
+	float a = roughness * roughness;
+	float D = pow(a, 2.0f) / (PI*pow(pow(glm::dot(N, H), 2.0f)*(pow(a, 2.0f) - 1.0f) + 1.0f, 2.0f));
+	return D;
+}
+
+float getSchlickGeo(glm::vec3 B, glm::vec3 N, float roughness) {
+	float k = pow(roughness + 1.0f, 2.0f) / 8.0f;
+	float G1 = glm::dot(N, B) / (glm::dot(N, B)*(1.0f - k) + k);
+	return G1;
+}
+
+float getGF(glm::vec3 L, glm::vec3 V, glm::vec3 N, float roughness) {
+	float GL = getSchlickGeo(L, N, roughness);
+	float GV = getSchlickGeo(V, N, roughness);
+	return GL*GV;
+}
+
+glm::vec3 shadeBasicFS(glm::vec3 texColor, glm::vec3 texN, glm::vec3 interPos, glm::vec3 interNormal, glm::vec3 interTangent, FrameUniforms &frame) {
+	glm::vec3 N = glm::normalize(interNormal);
+	glm::vec3 L = glm::normalize(glm::vec3(frame.light.pos) - interPos);
+
+	// Normal mapping
+	glm::vec3 T = glm::normalize(interTangent);
+	T = glm::normalize(T - glm::dot(T, N)*N);
+	glm::vec3 B = glm::normalize(glm::cross(N, T));
+	texN.x = texN.x*2.0f - 1.0f;
+	texN.y = texN.y*2.0f - 1.0f;
+	texN = glm::normalize(texN);
+	glm::mat3 toView = glm::mat3(T, B, N);
+	N = glm::normalize(toView*texN);
+
+	// Cook-Torrance
+	glm::vec3 V = glm::normalize(-interPos);
+	glm::vec3 F0 = getFresnelAtAngleZero(texColor, frame.metallic);
+	glm::vec3 H = glm::normalize(L + V);
+	glm::vec3 F = getFresnel(F0, L, H);
+
+	glm::vec3 kS = F;
+	glm::vec3 kD = 1.0f - kS;
+	kD *= (1.0f - frame.metallic);
+	kD *= texColor;
+	kD /= PI;
+
+	float NDF = getNDF(H, N, frame.roughness);
+	float G = getGF(L, V, N, frame.roughness);
+	kS *= NDF * G;
+	kS /= (4.0f * max(0.0f, glm::dot(N, L)) * max(0.0f, glm::dot(N, V))) + 0.0001f;
+
+	return (kD + kS)*glm::vec3(frame.light.color)*max(0.0f, glm::dot(N, L));
+}
+
+// Three FloatNs: one vec3 per lane
+struct Vec3N {
+	FloatN x, y, z;
+	Vec3N() {}
+	Vec3N(FloatN x, FloatN y, FloatN z) : x(x), y(y), z(z) {}
+	Vec3N(glm::vec3 a) : x(a.x), y(a.y), z(a.z) {}
+	friend Vec3N operator+(Vec3N a, Vec3N b) { return Vec3N(a.x + b.x, a.y + b.y, a.z + b.z); }
+	friend Vec3N operator-(Vec3N a, Vec3N b) { return Vec3N(a.x - b.x, a.y - b.y, a.z - b.z); }
+	friend Vec3N operator*(Vec3N a, Vec3N b) { return Vec3N(a.x * b.x, a.y * b.y, a.z * b.z); }
+	friend Vec3N operator*(Vec3N a, FloatN s) { return Vec3N(a.x * s, a.y * s, a.z * s); }
+};
+
+FloatN dotN(Vec3N a, Vec3N b) {
+	return a.x*b.x + a.y*b.y + a.z*b.z;
+}
+
+Vec3N crossN(Vec3N a, Vec3N b) {
+	return Vec3N(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
+}
+
+Vec3N normalizeN(Vec3N a) {
+	return a * (FloatN(1.0f) / sqrt(dotN(a, a)));
+}
+
+Vec3N loadVec3N(float (&src)[3][SHADE_BATCH], int i) {
+	return Vec3N(FloatN::load(&src[0][i]), FloatN::load(&src[1][i]), FloatN::load(&src[2][i]));
+}
+
+void storeVec3N(float (&dst)[3][SHADE_BATCH], int i, Vec3N v) {
+	v.x.store(&dst[0][i]);
+	v.y.store(&dst[1][i]);
+	v.z.store(&dst[2][i]);
+}
+
+void shadeBasicFSBatch(ShadeBatch &batch, int count, FrameUniforms &frame) {
+	if(count <= 0) return;
+
+	// Fill the rest of the last vector with copies of the last sample, so no lane shades uninitialized (or stale) data
+	int padded = min(SHADE_BATCH, (count + FloatN::WIDTH - 1) / FloatN::WIDTH * FloatN::WIDTH);
+	for(int lane = count; lane < padded; lane++) {
+		for(int c = 0; c < 3; c++) {
+			batch.texColor[c][lane] = batch.texColor[c][count - 1];
+			batch.texN[c][lane] = batch.texN[c][count - 1];
+			batch.interPos[c][lane] = batch.interPos[c][count - 1];
+			batch.interNormal[c][lane] = batch.interNormal[c][count - 1];
+			batch.interTangent[c][lane] = batch.interTangent[c][count - 1];
+		}
+	}
+
+	const FloatN zero(0.0f), one(1.0f), two(2.0f);
+	const FloatN metallic(frame.metallic);
+	const Vec3N lightPos(glm::vec3(frame.light.pos));
+	const Vec3N lightColor(glm::vec3(frame.light.color));
+
+	// Terms that only depend on roughness
+	float a = frame.roughness * frame.roughness;
+	const FloatN a2(a*a);
+	const FloatN k((frame.roughness + 1.0f)*(frame.roughness + 1.0f) / 8.0f);
+
+	for(int i = 0; i < count; i += FloatN::WIDTH) {
+		Vec3N texColor = loadVec3N(batch.texColor, i);
+		Vec3N texN = loadVec3N(batch.texN, i);
+		Vec3N interPos = loadVec3N(batch.interPos, i);
+
+		Vec3N N = normalizeN(loadVec3N(batch.interNormal, i));
+		Vec3N L = normalizeN(lightPos - interPos);
+
+		// Normal mapping
+		Vec3N T = normalizeN(loadVec3N(batch.interTangent, i));
+		T = normalizeN(T - N*dotN(T, N));
+		Vec3N B = normalizeN(crossN(N, T));
+		texN.x = texN.x*two - one;
+		texN.y = texN.y*two - one;
+		texN = normalizeN(texN);
+		N = normalizeN(T*texN.x + B*texN.y + N*texN.z);
+
+		// Cook-Torrance
+		Vec3N V = normalizeN(Vec3N(zero - interPos.x, zero - interPos.y, zero - interPos.z));
+		Vec3N F0 = Vec3N(glm::vec3(0.04f))*(one - metallic) + texColor*metallic;
+		Vec3N H = normalizeN(L + V);
+		FloatN oneMinusCos = one - max(zero, dotN(L, H));
+		FloatN fresnel = oneMinusCos*oneMinusCos;
+		fresnel = fresnel*fresnel*oneMinusCos;
+		Vec3N kS = F0 + (Vec3N(one, one, one) - F0)*fresnel;
+
+		Vec3N kD = (Vec3N(one, one, one) - kS) * ((one - metallic) * FloatN(1.0f / PI));
+		kD = kD*texColor;
+
+		FloatN NH = dotN(N, H);
+		FloatN denom = NH*NH*(a2 - one) + one;
+		FloatN NDF = a2 / (FloatN(PI)*denom*denom);
+
+		FloatN NL = dotN(N, L);
+		FloatN NV = dotN(N, V);
+		FloatN G = (NL / (NL*(one - k) + k)) * (NV / (NV*(one - k) + k));
+
+		FloatN NLpos = max(zero, NL);
+		kS = kS*(NDF*G / (FloatN(4.0f)*NLpos*max(zero, NV) + FloatN(0.0001f)));
+
+		storeVec3N(batch.color, i, (kD + kS)*lightColor*NLpos);
+	}
+}
+
+// Cook-Torrance part of shadeBasicFSReference, from the dot products it depends on
+glm::dvec3 cookTorranceReference(glm::dvec3 albedo, double NH, double NL, double NV, double LH, FrameUniforms &frame) {
+	const double pi = 3.14159265358979323846;
+	double metallic = frame.metallic;
+	double roughness = frame.roughness;
+
+	glm::dvec3 F0 = glm::dvec3(0.04)*(1.0 - metallic) + albedo*metallic;
+	glm::dvec3 kS = F0 + (glm::dvec3(1.0) - F0)*pow(1.0 - max(0.0, LH), 5.0);
+	glm::dvec3 kD = (glm::dvec3(1.0) - kS)*((1.0 - metallic)/pi)*albedo;
+
+	double a2 = pow(roughness*roughness, 2.0);
+	double NDF = a2 / (pi*pow(NH*NH*(a2 - 1.0) + 1.0, 2.0));
+	double k = pow(roughness + 1.0, 2.0) / 8.0;
+	double G = (NL / (NL*(1.0 - k) + k)) * (NV / (NV*(1.0 - k) + k));
+	kS = kS*(NDF*G / (4.0*max(0.0, NL)*max(0.0, NV) + 0.0001));
+
+	return (kD + kS)*glm::dvec3(glm::vec3(frame.light.color))*max(0.0, NL);
+}
+
+// Double-precision version of shadeBasicFS: the reference the float kernels are tested against.
+// allowedError is the error a float version can't avoid: the dot products going into Cook-Torrance are only
+// known to about one float ULP, and near the NDF peak at low roughness (or the pole of the Schlick G term,
+// since Basic.fs doesn't clamp N.V there) that small error is magnified far beyond one ULP of the result.
+glm::dvec3 shadeBasicFSReference(glm::vec3 texColor, glm::vec3 texN, glm::vec3 interPos, glm::vec3 interNormal, glm::vec3 interTangent,
+									FrameUniforms &frame, glm::dvec3 &allowedError) {
+	glm::dvec3 P(interPos);
+	glm::dvec3 N = glm::normalize(glm::dvec3(interNormal));
+	glm::dvec3 L = glm::normalize(glm::dvec3(glm::vec3(frame.light.pos)) - P);
+
+	// Normal mapping
+	glm::dvec3 T = glm::normalize(glm::dvec3(interTangent));
+	T = glm::normalize(T - N*glm::dot(T, N));
+	glm::dvec3 B = glm::normalize(glm::cross(N, T));
+	glm::dvec3 mapN = glm::normalize(glm::dvec3(texN.x*2.0 - 1.0, texN.y*2.0 - 1.0, (double)texN.z));
+	N = glm::normalize(T*mapN.x + B*mapN.y + N*mapN.z);
+
+	glm::dvec3 V = glm::normalize(-P);
+	glm::dvec3 H = glm::normalize(L + V);
+	double dots[4] = { glm::dot(N, H), glm::dot(N, L), glm::dot(N, V), glm::dot(L, H) };
+	glm::dvec3 albedo(texColor);
+	glm::dvec3 result = cookTorranceReference(albedo, dots[0], dots[1], dots[2], dots[3], frame);
+
+	// Add up how far the result moves when each dot product moves by one ULP (of 1.0) either way
+	const double ulp = numeric_limits<float>::epsilon();
+	for(int c = 0; c < 3; c++) {
+		allowedError[c] = ulp*max(1.0, fabs(result[c]));
+	}
+	for(int i = 0; i < 4; i++) {
+		for(double step : { -ulp, ulp }) {
+			double moved[4] = { dots[0], dots[1], dots[2], dots[3] };
+			moved[i] += step;
+			glm::dvec3 other = cookTorranceReference(albedo, moved[0], moved[1], moved[2], moved[3], frame);
+			for(int c = 0; c < 3; c++) {
+				allowedError[c] += 0.5*fabs(other[c] - result[c]);
+			}
+		}
+	}
+	return result;
+}
+
+// Largest error runShadingTest allows for shadeBasicFSBatch against the double-precision reference,
+// as a multiple of the error float math can't avoid for the sample (the SSE and AVX2/FMA kernels stay under
+// about 120; changing the specular term by 1% gives errors in the thousands)
+const double SHADE_TEST_TOLERANCE = 256.0;
+
+int runShadingTest(int sampleCnt) {
+	mt19937 rng(450);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	uniform_real_distribution<float> signedUnit(-1.0f, 1.0f);
+
+	// Random visible surface points in front of the camera (view space)
+	vector<ShadeBatch> batches((sampleCnt + SHADE_BATCH - 1) / SHADE_BATCH);
+	sampleCnt = (int)batches.size()*SHADE_BATCH;
+	for(ShadeBatch &batch : batches) {
+		for(int k = 0; k < SHADE_BATCH; k++) {
+			glm::vec3 pos(signedUnit(rng), signedUnit(rng), -0.5f - 2.0f*unit(rng));
+			glm::vec3 norm = glm::normalize(glm::vec3(signedUnit(rng), signedUnit(rng), signedUnit(rng)) + glm::vec3(0.0f, 0.0f, 0.01f));
+			if(glm::dot(norm, -pos) < 0.0f) norm = -norm;
+			ShadeBatch::set(batch.texColor, k, glm::vec3(unit(rng), unit(rng), unit(rng)));
+			ShadeBatch::set(batch.texN, k, glm::vec3(unit(rng), unit(rng), 0.5f + 0.5f*unit(rng)));
+			ShadeBatch::set(batch.interPos, k, pos);
+			ShadeBatch::set(batch.interNormal, k, norm);
+			ShadeBatch::set(batch.interTangent, k, glm::vec3(signedUnit(rng), signedUnit(rng), signedUnit(rng)));
+		}
+	}
+
+	float materials[3][2] = { { 0.0f, 0.1f }, { 0.5f, 0.4f }, { 1.0f, 0.7f } };
+	bool passed = true;
+	for(float (&material)[2] : materials) {
+		FrameUniforms frame;
+		frame.light = light;
+		frame.metallic = material[0];
+		frame.roughness = material[1];
+
+		// Double-precision reference, and the error a float version can't avoid for each sample
+		vector<glm::dvec3> reference(sampleCnt);
+		vector<glm::dvec3> allowed(sampleCnt);
+		for(int b = 0; b < batches.size(); b++) {
+			ShadeBatch &batch = batches[b];
+			for(int k = 0; k < SHADE_BATCH; k++) {
+				reference[b*SHADE_BATCH + k] = shadeBasicFSReference(ShadeBatch::get(batch.texColor, k), ShadeBatch::get(batch.texN, k),
+					ShadeBatch::get(batch.interPos, k), ShadeBatch::get(batch.interNormal, k), ShadeBatch::get(batch.interTangent, k), frame,
+					allowed[b*SHADE_BATCH + k]);
+			}
+		}
+
+		// Scalar float version
+		vector<glm::vec3> scalar(sampleCnt);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for(int b = 0; b < batches.size(); b++) {
+			ShadeBatch &batch = batches[b];
+			for(int k = 0; k < SHADE_BATCH; k++) {
+				scalar[b*SHADE_BATCH + k] = shadeBasicFS(ShadeBatch::get(batch.texColor, k), ShadeBatch::get(batch.texN, k),
+					ShadeBatch::get(batch.interPos, k), ShadeBatch::get(batch.interNormal, k), ShadeBatch::get(batch.interTangent, k), frame);
+			}
+		}
+		double scalarMS = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		// Batched kernel
+		start = chrono::steady_clock::now();
+		for(ShadeBatch &batch : batches) {
+			shadeBasicFSBatch(batch, SHADE_BATCH, frame);
+		}
+		double batchMS = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		// Unclamped (HDR) error is measured in units of the unavoidable error; clamped (display) error in [0,1] units
+		double maxScalarError = 0.0;
+		double maxBatchError = 0.0;
+		double maxDisplayError = 0.0;
+		for(int b = 0; b < batches.size(); b++) {
+			for(int k = 0; k < SHADE_BATCH; k++) {
+				glm::dvec3 expected = reference[b*SHADE_BATCH + k];
+				glm::vec3 actual = ShadeBatch::get(batches[b].color, k);
+				for(int c = 0; c < 3; c++) {
+					double scale = allowed[b*SHADE_BATCH + k][c];
+					double scalarError = fabs(scalar[b*SHADE_BATCH + k][c] - expected[c]) / scale;
+					double batchError = fabs(actual[c] - expected[c]) / scale;
+					double displayError = fabs(glm::clamp(actual[c], 0.0f, 1.0f) - min(1.0, max(0.0, expected[c])));
+					if(!(scalarError <= maxScalarError)) maxScalarError = scalarError;
+					if(!(batchError <= maxBatchError)) maxBatchError = batchError;
+					if(!(displayError <= maxDisplayError)) maxDisplayError = displayError;
+				}
+			}
+		}
+
+		cout << "metallic " << frame.metallic << ", roughness " << frame.roughness << ": ";
+		cout << "max error " << maxBatchError << " (scalar " << maxScalarError << ", display " << maxDisplayError << "), ";
+		cout << "scalar " << sampleCnt / (scalarMS / 1000.0) << " samples/sec, ";
+		cout << FloatN::WIDTH << "-wide " << sampleCnt / (batchMS / 1000.0) << " samples/sec" << endl;
+		if(!(maxBatchError <= SHADE_TEST_TOLERANCE)) passed = false;
+		if(!(maxDisplayError <= 0.5 / 255.0)) passed = false;
+	}
+
+	cout << (passed ? "Shading test passed" : "Shading test FAILED") << endl;
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "BasicGraphics.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// CPU version of main() in Basic.fs; texColor and texN are the raw texture lookups
+glm::vec3 shadeBasicFS(glm::vec3 texColor, glm::vec3 texN, glm::vec3 interPos, glm::vec3 interNormal, glm::vec3 interTangent, FrameUniforms &frame);
+
+// Float vector type for the batched shading kernel: 8 lanes with AVX2, 4 with SSE, plain floats otherwise
+#if defined(__AVX2__)
+struct FloatN {
+	static constexpr int WIDTH = 8;
+	__m256 v;
+	FloatN() {}
+	FloatN(__m256 x) : v(x) {}
+	FloatN(float x) : v(_mm256_set1_ps(x)) {}
+	static FloatN load(const float *p) { return _mm256_load_ps(p); }
+	void store(float *p) const { _mm256_store_ps(p, v); }
+	friend FloatN operator+(FloatN a, FloatN b) { return _mm256_add_ps(a.v, b.v); }
+	friend FloatN operator-(FloatN a, FloatN b) { return _mm256_sub_ps(a.v, b.v); }
+	friend FloatN operator*(FloatN a, FloatN b) { return _mm256_mul_ps(a.v, b.v); }
+	friend FloatN operator/(FloatN a, FloatN b) { return _mm256_div_ps(a.v, b.v); }
+	friend FloatN min(FloatN a, FloatN b) { return _mm256_min_ps(a.v, b.v); }
+	friend FloatN max(FloatN a, FloatN b) { return _mm256_max_ps(a.v, b.v); }
+	friend FloatN sqrt(FloatN a) { return _mm256_sqrt_ps(a.v); }
+	// Comparisons give a mask (all bits set in lanes where true); movemask packs the lanes' top bits into an int
+	friend FloatN cmplt(FloatN a, FloatN b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+	friend FloatN cmple(FloatN a, FloatN b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+	friend FloatN cmpge(FloatN a, FloatN b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+	friend FloatN operator&(FloatN a, FloatN b) { return _mm256_and_ps(a.v, b.v); }
+	int movemask() const { return _mm256_movemask_ps(v); }
+	static FloatN laneIndex() { return _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f); }
+};
+#elif defined(__SSE2__) || defined(_M_X64)
+struct FloatN {
+	static constexpr int WIDTH = 4;
+	__m128 v;
+	FloatN() {}
+	FloatN(__m128 x) : v(x) {}
+	FloatN(float x) : v(_mm_set1_ps(x)) {}
+	static FloatN load(const float *p) { return _mm_load_ps(p); }
+	void store(float *p) const { _mm_store_ps(p, v); }
+	friend FloatN operator+(FloatN a, FloatN b) { return _mm_add_ps(a.v, b.v); }
+	friend FloatN operator-(FloatN a, FloatN b) { return _mm_sub_ps(a.v, b.v); }
+	friend FloatN operator*(FloatN a, FloatN b) { return _mm_mul_ps(a.v, b.v); }
+	friend FloatN operator/(FloatN a, FloatN b) { return _mm_div_ps(a.v, b.v); }
+	friend FloatN min(FloatN a, FloatN b) { return _mm_min_ps(a.v, b.v); }
+	friend FloatN max(FloatN a, FloatN b) { return _mm_max_ps(a.v, b.v); }
+	friend FloatN sqrt(FloatN a) { return _mm_sqrt_ps(a.v); }
+	// Comparisons give a mask (all bits set in lanes where true); movemask packs the lanes' top bits into an int
+	friend FloatN cmplt(FloatN a, FloatN b) { return _mm_cmplt_ps(a.v, b.v); }
+	friend FloatN cmple(FloatN a, FloatN b) { return _mm_cmple_ps(a.v, b.v); }
+	friend FloatN cmpge(FloatN a, FloatN b) { return _mm_cmpge_ps(a.v, b.v); }
+	friend FloatN operator&(FloatN a, FloatN b) { return _mm_and_ps(a.v, b.v); }
+	int movemask() const { return _mm_movemask_ps(v); }
+	static FloatN laneIndex() { return _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f); }
+};
+#else
+struct FloatN {
+	static constexpr int WIDTH = 4;
+	float v[4];
+	FloatN() {}
+	FloatN(float x) { for(int i = 0; i < WIDTH; i++) v[i] = x; }
+	static FloatN load(const float *p) { FloatN r; for(int i = 0; i < WIDTH; i++) r.v[i] = p[i]; return r; }
+	void store(float *p) const { for(int i = 0; i < WIDTH; i++) p[i] = v[i]; }
+	friend FloatN operator+(FloatN a, FloatN b) { for(int i = 0; i < WIDTH; i++) a.v[i] += b.v[i]; return a; }
+	friend FloatN operator-(FloatN a, FloatN b) { for(int i = 0; i < WIDTH; i++) a.v[i] -= b.v[i]; return a; }
+	friend FloatN operator*(FloatN a, FloatN b) { for(int i = 0; i < WIDTH; i++) a.v[i] *= b.v[i]; return a; }
+	friend FloatN operator/(FloatN a, FloatN b) { for(int i = 0; i < WIDTH; i++) a.v[i] /= b.v[i]; return a; }
+	friend FloatN min(FloatN a, FloatN b) { for(int i = 0; i < WIDTH; i++) a.v[i] = (b.v[i] < a.v[i]) ? b.v[i] : a.v[i]; return a; }
+	friend FloatN max(FloatN a, FloatN b) { for(int i = 0; i < WIDTH; i++) a.v[i] = (b.v[i] > a.v[i]) ? b.v[i] : a.v[i]; return a; }
+	friend FloatN sqrt(FloatN a) { for(int i = 0; i < WIDTH; i++) a.v[i] = std::sqrt(a.v[i]); return a; }
+	// Comparisons give a mask (all bits set in lanes where true); movemask packs the lanes' top bits into an int
+	friend FloatN cmplt(FloatN a, FloatN b) { for(int i = 0; i < WIDTH; i++) a.v[i] = maskLane(a.v[i] < b.v[i]); return a; }
+	friend FloatN cmple(FloatN a, FloatN b) { for(int i = 0; i < WIDTH; i++) a.v[i] = maskLane(a.v[i] <= b.v[i]); return a; }
+	friend FloatN cmpge(FloatN a, FloatN b) { for(int i = 0; i < WIDTH; i++) a.v[i] = maskLane(a.v[i] >= b.v[i]); return a; }
+	friend FloatN operator&(FloatN a, FloatN b) {
+		for(int i = 0; i < WIDTH; i++) {
+			unsigned int x, y;
+			memcpy(&x, &a.v[i], sizeof(x));
+			memcpy(&y, &b.v[i], sizeof(y));
+			x &= y;
+			memcpy(&a.v[i], &x, sizeof(x));
+		}
+		return a;
+	}
+	int movemask() const {
+		int mask = 0;
+		for(int i = 0; i < WIDTH; i++) {
+			unsigned int x;
+			memcpy(&x, &v[i], sizeof(x));
+			mask |= (int)(x >> 31) << i;
+		}
+		return mask;
+	}
+	static FloatN laneIndex() { FloatN r; for(int i = 0; i < WIDTH; i++) r.v[i] = (float)i; return r; }
+	static float maskLane(bool b) { unsigned int x = b ? 0xffffffffu : 0u; float f; memcpy(&f, &x, sizeof(f)); return f; }
+};
+#endif
+
+// Number of samples shaded per call to shadeBasicFSBatch
+const int SHADE_BATCH = 16;
+
+// Shading inputs and outputs for SHADE_BATCH samples, stored SoA (one array per vector component)
+struct ShadeBatch {
+	alignas(32) float texColor[3][SHADE_BATCH];
+	alignas(32) float texN[3][SHADE_BATCH];
+	alignas(32) float interPos[3][SHADE_BATCH];
+	alignas(32) float interNormal[3][SHADE_BATCH];
+	alignas(32) float interTangent[3][SHADE_BATCH];
+	alignas(32) float color[3][SHADE_BATCH];
+
+	static void set(float (&dst)[3][SHADE_BATCH], int lane, glm::vec3 v) {
+		dst[0][lane] = v.x;
+		dst[1][lane] = v.y;
+		dst[2][lane] = v.z;
+	}
+
+	static glm::vec3 get(float (&src)[3][SHADE_BATCH], int lane) {
+		return glm::vec3(src[0][lane], src[1][lane], src[2][lane]);
+	}
+};
+
+// Batched version of shadeBasicFS for the first count samples of batch (results go to batch.color).
+// Same math as Basic.fs, with the integer pow() calls written out as multiplies.
+void shadeBasicFSBatch(ShadeBatch &batch, int count, FrameUniforms &frame);
+
+// Check shadeBasicFSBatch against a double-precision reference on random samples, then time it against the scalar shadeBasicFS
+int runShadingTest(int sampleCnt);
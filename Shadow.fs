@@ -0,0 +1,18 @@
+#version 430 core
+
+in vec3 shadowWorldPos;
+
+// Shadow constants (only rewritten when the shadow map is re-rendered)
+layout(std140, binding = 2) uniform ShadowData {
+	mat4 shadowMats[6];
+	vec4 shadowLightPos;
+	float shadowFar;
+	float shadowBias;
+	int shadowsEnabled;
+};
+
+void main()
+{
+	// Store linear distance to the light, so every face compares the same quantity
+	gl_FragDepth = length(shadowWorldPos - vec3(shadowLightPos)) / shadowFar;
+}
@@ -0,0 +1,42 @@
+#version 430 core
+
+// One invocation per cube face, so all six faces are drawn in a single pass
+layout(triangles, invocations = 6) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+in vec3 worldPos[];
+
+out vec3 shadowWorldPos;
+
+// Shadow constants (only rewritten when the shadow map is re-rendered)
+layout(std140, binding = 2) uniform ShadowData {
+	mat4 shadowMats[6];
+	vec4 shadowLightPos;
+	float shadowFar;
+	float shadowBias;
+	int shadowsEnabled;
+};
+
+void main()
+{
+	mat4 faceMat = shadowMats[gl_InvocationID];
+	vec4 clipPos[3];
+	for(int i = 0; i < 3; i++) {
+		clipPos[i] = faceMat * vec4(worldPos[i], 1.0);
+	}
+
+	// Skip triangles entirely outside this face's frustum
+	for(int axis = 0; axis < 3; axis++) {
+		vec3 c = vec3(clipPos[0][axis], clipPos[1][axis], clipPos[2][axis]);
+		vec3 w = vec3(clipPos[0].w, clipPos[1].w, clipPos[2].w);
+		if(all(greaterThan(c, w)) || all(lessThan(c, -w))) return;
+	}
+
+	for(int i = 0; i < 3; i++) {
+		gl_Layer = gl_InvocationID;
+		gl_Position = clipPos[i];
+		shadowWorldPos = worldPos[i];
+		EmitVertex();
+	}
+	EndPrimitive();
+}
@@ -0,0 +1,18 @@
+#version 430 core
+
+layout(location=0) in vec3 position;
+
+out vec3 worldPos;
+
+// Per-draw constants (bound by offset into the uniform ring buffer for every draw)
+layout(std140, binding = 1) uniform DrawData {
+	mat4 modelMat;
+	mat4 normMat;
+};
+
+void main()
+{
+	// Faces are projected in the geometry shader; just go to world space here
+	worldPos = vec3(modelMat * vec4(position, 1.0));
+	gl_Position = vec4(worldPos, 1.0);
+}
@@ -0,0 +1,436 @@
+#include "SoftwareRasterizer.h"
+#include "ShadingKernel.h"
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+void loadSoftTexture(string filename, SoftTexture &tex) {
+	stbi_set_flip_vertically_on_load(1);
+	unsigned char* tex_image = stbi_load(filename.c_str(), &tex.width, &tex.height, &tex.channels, 0);
+	if(!tex_image) {
+		cout << "COULD NOT LOAD TEXTURE: " << filename << endl;
+		throw runtime_error("COULD NOT LOAD TEXTURE: " + filename);
+	}
+	tex.data.assign(tex_image, tex_image + tex.width*tex.height*tex.channels);
+	stbi_image_free(tex_image);
+}
+
+glm::vec3 sampleSoftTexture(SoftTexture &tex, glm::vec2 uv) {
+	float x = uv.x*tex.width - 0.5f;
+	float y = uv.y*tex.height - 0.5f;
+	float fx0 = floor(x);
+	float fy0 = floor(y);
+	float fx = x - fx0;
+	float fy = y - fy0;
+	int x0 = (int)fx0;
+	int y0 = (int)fy0;
+
+	auto texel = [&](int tx, int ty) {
+		tx = ((tx % tex.width) + tex.width) % tex.width;
+		ty = ((ty % tex.height) + tex.height) % tex.height;
+		unsigned char *p = &tex.data[(ty*tex.width + tx)*tex.channels];
+		return glm::vec3(p[0], p[1], p[2]) / 255.0f;
+	};
+
+	glm::vec3 bottom = glm::mix(texel(x0, y0), texel(x0 + 1, y0), fx);
+	glm::vec3 top = glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx);
+	return glm::mix(bottom, top, fy);
+}
+
+SoftwareRasterizer::SoftwareRasterizer(int width, int height) : width(width), height(height) {
+	color.resize(width*height*4);
+	depth.resize(width*height);
+	tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+void SoftwareRasterizer::clear(glm::vec4 clearColor) {
+	unsigned char c[4];
+	for(int i = 0; i < 4; i++) {
+		c[i] = toByte(clearColor[i]);
+	}
+	for(int i = 0; i < width*height; i++) {
+		memcpy(&color[i*4], c, 4);
+		depth[i] = 1.0f;
+	}
+	trianglesDrawn = 0;
+	pixelsShaded = 0;
+}
+
+void SoftwareRasterizer::draw(vector<Mesh> &meshes, vector<SceneNode> &nodes, vector<DrawUniforms> &draws, FrameUniforms &frame,
+			SoftTexture &diffuse, SoftTexture &normal, WorkerPool &pool) {
+	// One instance per mesh per node, with offsets into the shared vertex and triangle arrays
+	struct Instance { int mesh; int node; int vertexBase; int triBase; };
+	vector<Instance> instances;
+	int vertexCnt = 0;
+	int triCnt = 0;
+	for(int i = 0; i < nodes.size(); i++) {
+		for(int index : nodes[i].meshIndices) {
+			instances.push_back({ index, i, vertexCnt, triCnt });
+			vertexCnt += (int)meshes[index].vertices.size();
+			triCnt += (int)meshes[index].indices.size() / 3;
+		}
+	}
+	verts.resize(vertexCnt);
+	tris.resize(triCnt);
+
+	// Vertex stage (Basic.vs)
+	pool.parallelFor((int)instances.size(), [&](int i) {
+		Instance &inst = instances[i];
+		Mesh &m = meshes[inst.mesh];
+		glm::mat4 modelView = frame.viewMat * draws[inst.node].modelMat;
+		glm::mat4 MVP = frame.projMat * modelView;
+		glm::mat3 normMat = glm::mat3(draws[inst.node].normMat);
+		for(int k = 0; k < m.vertices.size(); k++) {
+			Vertex &v = m.vertices[k];
+			SoftVertex &sv = verts[inst.vertexBase + k];
+			glm::vec4 objPos = glm::vec4(v.position, 1.0);
+			sv.clipPos = MVP * objPos;
+			sv.interPos = glm::vec3(modelView * objPos);
+			sv.interNormal = normMat * v.normal;
+			sv.interUV = v.texcoords;
+			sv.interTangent = glm::vec3(modelView * glm::vec4(v.tangent, 0.0));
+		}
+	});
+
+	// Triangle setup (triangles crossing the near plane are set aside for clipping)
+	vector<vector<int>> crossing(instances.size());
+	pool.parallelFor((int)instances.size(), [&](int i) {
+		Instance &inst = instances[i];
+		Mesh &m = meshes[inst.mesh];
+		for(int t = 0; t < m.indices.size() / 3; t++) {
+			SoftTriangle &tri = tris[inst.triBase + t];
+			int insideCnt = 0;
+			for(int k = 0; k < 3; k++) {
+				tri.v[k] = inst.vertexBase + m.indices[t*3 + k];
+				if(nearDistance(verts[tri.v[k]].clipPos) >= 0.0f) insideCnt++;
+			}
+			if(insideCnt == 3) {
+				setupTriangle(tri);
+			}
+			else {
+				tri.visible = false;
+				if(insideCnt > 0) crossing[i].push_back(inst.triBase + t);
+			}
+		}
+	});
+
+	// Clip them like OpenGL does: the part in front of the near plane is a triangle, which keeps the original's place,
+	// or a quad, whose second triangle is added at the end (new vertices are added after the mesh vertices)
+	for(vector<int> &list : crossing) {
+		for(int t : list) {
+			SoftVertex polygon[4];
+			int cornerCnt = clipNear(tris[t], polygon);
+			int base = (int)verts.size();
+			verts.insert(verts.end(), polygon, polygon + cornerCnt);
+			tris[t].v[0] = base;
+			tris[t].v[1] = base + 1;
+			tris[t].v[2] = base + 2;
+			setupTriangle(tris[t]);
+			if(cornerCnt == 4) {
+				SoftTriangle extra;
+				extra.v[0] = base;
+				extra.v[1] = base + 2;
+				extra.v[2] = base + 3;
+				setupTriangle(extra);
+				tris.push_back(extra);
+			}
+		}
+	}
+	triCnt = (int)tris.size();
+
+	// Binning: each batch of triangles bins into its own lists, so tiles can replay batches in submission order
+	int batchCnt = max(1, min(64, triCnt / 256));
+	int batchSize = (triCnt + batchCnt - 1) / batchCnt;
+	int tileCnt = tilesX*tilesY;
+	bins.resize(batchCnt);
+	pool.parallelFor(batchCnt, [&](int b) {
+		bins[b].assign(tileCnt, vector<int>());
+		int end = min(triCnt, (b + 1)*batchSize);
+		for(int t = b*batchSize; t < end; t++) {
+			SoftTriangle &tri = tris[t];
+			if(!tri.visible) continue;
+			for(int ty = tri.minY / TILE_SIZE; ty <= tri.maxY / TILE_SIZE; ty++) {
+				for(int tx = tri.minX / TILE_SIZE; tx <= tri.maxX / TILE_SIZE; tx++) {
+					bins[b][ty*tilesX + tx].push_back(t);
+				}
+			}
+		}
+	});
+
+	// Rasterize and shade (Basic.fs), one tile per job
+	atomic<unsigned long long> shaded{0};
+	pool.parallelFor(tileCnt, [&](int tile) {
+		unsigned long long tileShaded = 0;
+		for(int b = 0; b < batchCnt; b++) {
+			for(int t : bins[b][tile]) {
+				tileShaded += rasterizeTriangle(tris[t], tile, frame, diffuse, normal);
+			}
+		}
+		shaded += tileShaded;
+	});
+
+	for(SoftTriangle &tri : tris) {
+		if(tri.visible) trianglesDrawn++;
+	}
+	pixelsShaded += shaded.load();
+}
+
+void SoftwareRasterizer::setupTriangle(SoftTriangle &tri) {
+	for(int k = 0; k < 3; k++) {
+		glm::vec4 clip = verts[tri.v[k]].clipPos;
+		tri.invW[k] = 1.0f / clip.w;
+		glm::vec3 ndc = glm::vec3(clip) * tri.invW[k];
+		tri.screen[k] = glm::vec3((ndc.x*0.5f + 0.5f)*width, (ndc.y*0.5f + 0.5f)*height, ndc.z*0.5f + 0.5f);
+	}
+
+	// Vertices just in front of the near plane can land far outside the viewport, so the bounds are clamped
+	// before they are converted to int (converting a float out of int range, or NaN, is undefined)
+	glm::vec3 lo = glm::min(tri.screen[0], glm::min(tri.screen[1], tri.screen[2]));
+	glm::vec3 hi = glm::max(tri.screen[0], glm::max(tri.screen[1], tri.screen[2]));
+	if(!(lo.x < width && lo.y < height && hi.x > -1.0f && hi.y > -1.0f)) {
+		tri.visible = false;
+		return;
+	}
+	tri.minX = (int)floor(max(lo.x, 0.0f));
+	tri.minY = (int)floor(max(lo.y, 0.0f));
+	tri.maxX = (int)ceil(min(hi.x, width - 1.0f));
+	tri.maxY = (int)ceil(min(hi.y, height - 1.0f));
+	float area = edge(tri.screen[0], tri.screen[1], tri.screen[2]);
+	tri.visible = tri.minX <= tri.maxX && tri.minY <= tri.maxY && area != 0.0f;
+}
+
+int SoftwareRasterizer::clipNear(SoftTriangle &tri, SoftVertex *polygon) {
+	// Every output of the vertex stage is linear in clip space, so the new corners are plain interpolations
+	auto lerpVertex = [](SoftVertex &a, SoftVertex &b, float t) {
+		SoftVertex v;
+		v.clipPos = a.clipPos + (b.clipPos - a.clipPos)*t;
+		v.interPos = glm::mix(a.interPos, b.interPos, t);
+		v.interNormal = glm::mix(a.interNormal, b.interNormal, t);
+		v.interUV = a.interUV + (b.interUV - a.interUV)*t;
+		v.interTangent = glm::mix(a.interTangent, b.interTangent, t);
+		return v;
+	};
+
+	int cornerCnt = 0;
+	for(int k = 0; k < 3; k++) {
+		SoftVertex &a = verts[tri.v[k]];
+		SoftVertex &b = verts[tri.v[(k + 1) % 3]];
+		float da = nearDistance(a.clipPos);
+		float db = nearDistance(b.clipPos);
+		if(da >= 0.0f) polygon[cornerCnt++] = a;
+		if((da >= 0.0f) != (db >= 0.0f)) polygon[cornerCnt++] = lerpVertex(a, b, da / (da - db));
+	}
+	return cornerCnt;
+}
+
+unsigned char SoftwareRasterizer::toByte(float v) {
+	if(!(v > 0.0f)) return 0;
+	if(v >= 1.0f) return 255;
+	return (unsigned char)(v*255.0f + 0.5f);
+}
+
+int SoftwareRasterizer::rasterizeTriangle(SoftTriangle &tri, int tile, FrameUniforms &frame, SoftTexture &diffuse, SoftTexture &normal) {
+	int x0 = max(tri.minX, (tile % tilesX)*TILE_SIZE);
+	int y0 = max(tri.minY, (tile / tilesX)*TILE_SIZE);
+	int x1 = min(tri.maxX, (tile % tilesX)*TILE_SIZE + TILE_SIZE - 1);
+	int y1 = min(tri.maxY, (tile / tilesX)*TILE_SIZE + TILE_SIZE - 1);
+
+	glm::vec3 *s = tri.screen;
+	float area = edge(s[0], s[1], s[2]);
+	// No face culling in the OpenGL path, so flip clockwise triangles instead of dropping them
+	float sign = (area < 0.0f) ? -1.0f : 1.0f;
+	float invArea = 1.0f / (area*sign);
+
+	// Edge function steps per pixel in x and y
+	float dx0 = -(s[2].y - s[1].y)*sign, dy0 = (s[2].x - s[1].x)*sign;
+	float dx1 = -(s[0].y - s[2].y)*sign, dy1 = (s[0].x - s[2].x)*sign;
+	float dx2 = -(s[1].y - s[0].y)*sign, dy2 = (s[1].x - s[0].x)*sign;
+
+	glm::vec3 start = glm::vec3(x0 + 0.5f, y0 + 0.5f, 0.0f);
+	float row0 = edge(s[1], s[2], start)*sign;
+	float row1 = edge(s[2], s[0], start)*sign;
+	float row2 = edge(s[0], s[1], start)*sign;
+
+	SoftVertex &v0 = verts[tri.v[0]];
+	SoftVertex &v1 = verts[tri.v[1]];
+	SoftVertex &v2 = verts[tri.v[2]];
+
+	// Fragments that pass the depth test are collected and shaded SHADE_BATCH at a time
+	ShadeBatch batch;
+	int batchPixels[SHADE_BATCH];
+	int batchCnt = 0;
+	auto flushBatch = [&]() {
+		shadeBasicFSBatch(batch, batchCnt, frame);
+		for(int k = 0; k < batchCnt; k++) {
+			unsigned char *out = &color[batchPixels[k]*4];
+			out[0] = toByte(batch.color[0][k]);
+			out[1] = toByte(batch.color[1][k]);
+			out[2] = toByte(batch.color[2][k]);
+			out[3] = 255;
+		}
+		batchCnt = 0;
+	};
+
+	// Edge functions, coverage, depth and perspective weights are worked out FloatN::WIDTH pixels of a row at a time
+	const FloatN zero(0.0f), one(1.0f);
+	const FloatN laneX = FloatN::laneIndex();
+	const FloatN stepX0(dx0), stepX1(dx1), stepX2(dx2);
+	const FloatN invAreaN(invArea);
+	const FloatN z0(s[0].z), z1(s[1].z), z2(s[2].z);
+	const FloatN invW0(tri.invW[0]), invW1(tri.invW[1]), invW2(tri.invW[2]);
+	alignas(32) float spanDepth[FloatN::WIDTH];
+	alignas(32) float spanZ[FloatN::WIDTH];
+	alignas(32) float spanP[3][FloatN::WIDTH];
+
+	int shadedCnt = 0;
+	for(int y = y0; y <= y1; y++) {
+		FloatN rowN0(row0), rowN1(row1), rowN2(row2);
+		for(int x = x0; x <= x1; x += FloatN::WIDTH) {
+			int spanCnt = min(FloatN::WIDTH, x1 - x + 1);
+			FloatN offset = FloatN((float)(x - x0)) + laneX;
+			FloatN w0 = rowN0 + offset*stepX0;
+			FloatN w1 = rowN1 + offset*stepX1;
+			FloatN w2 = rowN2 + offset*stepX2;
+			int mask = (cmpge(w0, zero) & cmpge(w1, zero) & cmpge(w2, zero)).movemask() & ((1 << spanCnt) - 1);
+			if(!mask) continue;
+
+			// Depth test (only this span's pixels are read, since the next ones may belong to another tile)
+			float *depthRow = &depth[y*width + x];
+			memcpy(spanDepth, depthRow, spanCnt*sizeof(float));
+			FloatN b0 = w0*invAreaN, b1 = w1*invAreaN, b2 = w2*invAreaN;
+			FloatN z = b0*z0 + b1*z1 + b2*z2;
+			mask &= (cmpge(z, zero) & cmple(z, one) & cmplt(z, FloatN::load(spanDepth))).movemask();
+			if(!mask) continue;
+
+			// Perspective-correct barycentrics
+			FloatN p0 = b0*invW0, p1 = b1*invW1, p2 = b2*invW2;
+			FloatN invSum = one / (p0 + p1 + p2);
+			(p0*invSum).store(spanP[0]);
+			(p1*invSum).store(spanP[1]);
+			(p2*invSum).store(spanP[2]);
+			z.store(spanZ);
+
+			for(int k = 0; k < spanCnt; k++) {
+				if(!(mask & (1 << k))) continue;
+				depthRow[k] = spanZ[k];
+
+				float q0 = spanP[0][k], q1 = spanP[1][k], q2 = spanP[2][k];
+				glm::vec2 uv = v0.interUV*q0 + v1.interUV*q1 + v2.interUV*q2;
+				ShadeBatch::set(batch.texColor, batchCnt, sampleSoftTexture(diffuse, uv));
+				ShadeBatch::set(batch.texN, batchCnt, sampleSoftTexture(normal, uv));
+				ShadeBatch::set(batch.interPos, batchCnt, v0.interPos*q0 + v1.interPos*q1 + v2.interPos*q2);
+				ShadeBatch::set(batch.interNormal, batchCnt, v0.interNormal*q0 + v1.interNormal*q1 + v2.interNormal*q2);
+				ShadeBatch::set(batch.interTangent, batchCnt, v0.interTangent*q0 + v1.interTangent*q1 + v2.interTangent*q2);
+				batchPixels[batchCnt++] = y*width + x + k;
+				if(batchCnt == SHADE_BATCH) flushBatch();
+				shadedCnt++;
+			}
+		}
+		row0 += dy0; row1 += dy1; row2 += dy2;
+	}
+	if(batchCnt > 0) flushBatch();
+	return shadedCnt;
+}
+
+bool compareWithReference(vector<unsigned char> &image, int width, int height, string refFilename, double maxLimit, double rmsLimit) {
+	int refWidth, refHeight, refChannels;
+	stbi_set_flip_vertically_on_load(1);
+	unsigned char *ref = stbi_load(refFilename.c_str(), &refWidth, &refHeight, &refChannels, 4);
+	if(!ref) {
+		cout << "ERROR: Could not load reference image: " << refFilename << endl;
+		return false;
+	}
+	if(refWidth != width || refHeight != height) {
+		cout << "ERROR: Reference image is " << refWidth << "x" << refHeight << ", expected " << width << "x" << height << endl;
+		stbi_image_free(ref);
+		return false;
+	}
+
+	int maxError = 0;
+	double squaredSum = 0.0;
+	long long differing = 0;
+	for(int i = 0; i < width*height; i++) {
+		int pixelError = 0;
+		for(int c = 0; c < 3; c++) {
+			int diff = abs((int)image[i*4 + c] - (int)ref[i*4 + c]);
+			squaredSum += diff*diff;
+			pixelError = max(pixelError, diff);
+		}
+		if(pixelError > 0) differing++;
+		maxError = max(maxError, pixelError);
+	}
+	stbi_image_free(ref);
+
+	double rmsError = sqrt(squaredSum / (width*height*3.0));
+	bool passed = maxError <= maxLimit && rmsError <= rmsLimit;
+	cout << "Compared with " << refFilename << ": max error " << maxError << ", RMS error " << rmsError << ", ";
+	cout << differing << " of " << width*height << " pixels differ" << endl;
+	cout << (passed ? "Images match" : "Images DIFFER") << " (limits: max " << maxLimit << ", RMS " << rmsLimit << ")" << endl;
+	return passed;
+}
+
+int runSoftwareRenderer(const aiScene *scene, string outputFilename, int width, int height, int frameCnt,
+						string compareFilename, double compareMax, double compareRMS) {
+	// Keep CPU meshes (the rasterizer reads them directly)
+	vector<Mesh> meshes(scene->mNumMeshes);
+	for(int i = 0; i < scene->mNumMeshes; i++) {
+		extractMeshData(scene->mMeshes[i], meshes[i]);
+	}
+	vector<SceneNode> sceneNodes;
+	flattenScene(scene->mRootNode, glm::mat4(1.0), sceneNodes);
+
+	unsigned int hwThreads = thread::hardware_concurrency();
+	WorkerPool workerPool(hwThreads > 1 ? hwThreads - 1 : 0);
+
+	SoftTexture diffuse, normal;
+	try {
+		loadSoftTexture("4977210.jpg", diffuse);
+		loadSoftTexture("./sampleModels/NormalMap.png", normal);
+	}
+	catch (exception &e) {
+		return EXIT_FAILURE;
+	}
+
+	// Same per-frame constants as the OpenGL path
+	FrameUniforms frame;
+	double aspectRatio = width/height;
+	frame.viewMat = glm::lookAt(eye, lookAt, glm::vec3(0,1,0));
+	frame.projMat = glm::perspective(glm::radians(90.0), aspectRatio, 0.01, 50.0);
+	frame.light = light;
+	frame.roughness = roughness;
+	frame.metallic = metallic;
+
+	vector<DrawUniforms> draws(sceneNodes.size());
+	SoftwareRasterizer rasterizer(width, height);
+	double totalMS = 0.0;
+	for(int i = 0; i < frameCnt; i++) {
+		chrono::steady_clock::time_point frameStart = chrono::steady_clock::now();
+		// Every node is drawn; triangle setup drops the triangles that are off screen
+		workerPool.parallelFor((int)sceneNodes.size(), [&](int n) {
+			writeDrawUniforms(nodeWorldMatrix(sceneNodes[n]), frame.viewMat, &draws[n]);
+		});
+		// Same as glClearColor in main() (clamped to [0,1])
+		rasterizer.clear(glm::vec4(0.0f, 216.0f, 255.0f, 1.0f));
+		rasterizer.draw(meshes, sceneNodes, draws, frame, diffuse, normal, workerPool);
+		totalMS += chrono::duration<double, milli>(chrono::steady_clock::now() - frameStart).count();
+	}
+
+	double seconds = totalMS / 1000.0;
+	cout << "Software rasterizer: " << width << "x" << height << ", " << (workerPool.threadCount() + 1) << " threads" << endl;
+	cout << "Average frame time: " << totalMS / frameCnt << " ms" << endl;
+	cout << "Triangles/sec: " << rasterizer.trianglesDrawn * frameCnt / seconds << endl;
+	cout << "Pixels/sec: " << rasterizer.pixelsShaded * frameCnt / seconds << endl;
+
+	// Rows are bottom first, like the OpenGL framebuffer
+	stbi_flip_vertically_on_write(1);
+	if(!stbi_write_png(outputFilename.c_str(), width, height, 4, rasterizer.color.data(), width*4)) {
+		cout << "ERROR: Could not write image: " << outputFilename << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Wrote " << outputFilename << endl;
+
+	if(!compareFilename.empty() && !compareWithReference(rasterizer.color, width, height, compareFilename, compareMax, compareRMS)) {
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "BasicGraphics.h"
+
+// Struct for holding a decoded texture on the CPU (for the software rasterizer)
+struct SoftTexture {
+	int width = 0;
+	int height = 0;
+	int channels = 0;
+	vector<unsigned char> data;
+};
+
+// Decode texture into CPU memory (flipped the same way as loadAndCreateTexture)
+void loadSoftTexture(string filename, SoftTexture &tex);
+
+// Bilinear texture lookup with repeat wrapping (matches GL_LINEAR and GL_REPEAT)
+glm::vec3 sampleSoftTexture(SoftTexture &tex, glm::vec2 uv);
+
+// Vertex after the software vertex stage (same outputs as Basic.vs)
+struct SoftVertex {
+	glm::vec4 clipPos;
+	glm::vec3 interPos;
+	glm::vec3 interNormal;
+	glm::vec2 interUV;
+	glm::vec3 interTangent;
+};
+
+// Triangle after setup: screen-space positions (x, y in pixels, z = depth) and 1/w for perspective correction
+struct SoftTriangle {
+	glm::vec3 screen[3];
+	float invW[3];
+	int v[3];
+	int minX, minY, maxX, maxY;
+	bool visible;
+};
+
+// Tile-binned software rasterizer that draws the scene on the CPU with the same shading as Basic.fs.
+// Triangles are set up and binned into screen tiles in parallel; each tile is then rasterized by one thread.
+class SoftwareRasterizer {
+public:
+	static const int TILE_SIZE = 64;
+
+	int width;
+	int height;
+	vector<unsigned char> color;	// RGBA8, bottom row first (like glReadPixels)
+	vector<float> depth;
+
+	unsigned long long trianglesDrawn = 0;
+	unsigned long long pixelsShaded = 0;
+
+	SoftwareRasterizer(int width, int height);
+
+	void clear(glm::vec4 clearColor);
+
+	// Draw every mesh of every node; draws[i] holds the constants of nodes[i]
+	void draw(vector<Mesh> &meshes, vector<SceneNode> &nodes, vector<DrawUniforms> &draws, FrameUniforms &frame,
+				SoftTexture &diffuse, SoftTexture &normal, WorkerPool &pool);
+
+private:
+	int tilesX;
+	int tilesY;
+	vector<SoftVertex> verts;
+	vector<SoftTriangle> tris;
+	vector<vector<vector<int>>> bins;
+
+	// Clamp color channel to [0,1] (NaN becomes 0) and convert to 8 bits, like the framebuffer does
+	static unsigned char toByte(float v);
+
+	// How far a clip-space position is in front of the near plane (z = -w); negative behind it
+	static float nearDistance(glm::vec4 clip) {
+		return clip.z + clip.w;
+	}
+
+	// Screen positions, 1/w and pixel bounds of a triangle whose vertices are all in front of the near plane
+	void setupTriangle(SoftTriangle &tri);
+
+	// Clip a triangle to the near plane; writes the 3 or 4 corners of what is in front of it (in order) to polygon
+	int clipNear(SoftTriangle &tri, SoftVertex *polygon);
+
+	// Edge function: positive if p is to the left of a->b
+	static float edge(glm::vec3 a, glm::vec3 b, glm::vec3 p) {
+		return (b.x - a.x)*(p.y - a.y) - (b.y - a.y)*(p.x - a.x);
+	}
+
+	// Rasterize the part of tri inside tile; returns number of pixels shaded
+	int rasterizeTriangle(SoftTriangle &tri, int tile, FrameUniforms &frame, SoftTexture &diffuse, SoftTexture &normal);
+};
+
+// Compare a rendered image (RGBA, bottom row first) with a reference PNG. Prints the largest and the RMS difference
+// of the color channels (in 8-bit steps) and returns whether both are within the given limits.
+bool compareWithReference(vector<unsigned char> &image, int width, int height, string refFilename, double maxLimit, double rmsLimit);
+
+// Software rendering mode: draw the scene on the CPU, report throughput and write the last frame to a PNG
+// (and, if compareFilename is given, fail unless the frame matches that reference image)
+int runSoftwareRenderer(const aiScene *scene, string outputFilename, int width, int height, int frameCnt,
+						string compareFilename, double compareMax, double compareRMS);